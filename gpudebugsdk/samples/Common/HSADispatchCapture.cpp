@@ -0,0 +1,582 @@
+//==============================================================================
+// Copyright (c) 2017 Advanced Micro Devices, Inc. All rights reserved.
+//
+/// \author AMD Developer Tools
+/// \file
+/// \brief  Capture kernel dispatches to a file, with their code object,
+///         kernel arguments and argument buffers, so that they can be
+///         replayed standalone.
+//==============================================================================
+#include <cstdlib>   // malloc, free
+#include <iostream>
+#include <utility>
+
+#include "HSADispatchCapture.h"
+
+namespace AMDT
+{
+
+// The capture file starts with gs_CAPTURE_MAGIC, followed by records made of a
+// uint32_t record type, a uint64_t payload size and the payload.
+//
+// RECORD_CODE_OBJECT payload: uint32_t code object id, serialized code object.
+// RECORD_DISPATCH payload:    uint32_t code object id,
+//                             uint32_t kernel symbol length, kernel symbol,
+//                             hsa_kernel_dispatch_packet_t,
+//                             uint64_t kernarg start offset, uint64_t kernarg size, kernarg block,
+//                             uint32_t buffer count, then for every buffer:
+//                             uint64_t size, uint32_t CaptureMemoryKind, uint32_t pointer argument count,
+//                             uint64_t kernarg offset of every pointer argument, buffer contents.
+static const char gs_CAPTURE_MAGIC[8] = { 'H', 'S', 'A', 'D', 'C', 'A', 'P', '2' };
+
+enum CaptureRecordType
+{
+    RECORD_CODE_OBJECT = 1,
+    RECORD_DISPATCH = 2
+};
+
+// Size of the type and payload size in front of every record.
+static const std::size_t gs_RECORD_HEADER_SIZE = sizeof(uint32_t) + sizeof(uint64_t);
+
+// Static local function declaration
+static void         BeginRecord(std::vector<char>& record, uint32_t type, std::size_t payloadSize);
+static void         AppendBytes(std::vector<char>& record, const void* pData, std::size_t size);
+static hsa_status_t AllocateSerializedCodeObject_Callback(size_t size, hsa_callback_data_t data, void** pAddress);
+
+template <typename T>
+static void AppendValue(std::vector<char>& record, const T& value)
+{
+    AppendBytes(record, &value, sizeof(T));
+}
+
+template <typename T>
+static bool ReadValue(const std::vector<char>& payload, std::size_t& pos, T& valueOut)
+{
+    if (payload.size() - pos < sizeof(T))
+    {
+        return false;
+    }
+
+    memcpy(&valueOut, &payload[pos], sizeof(T));
+    pos += sizeof(T);
+    return true;
+}
+
+// Check that count elements of at least elementSize bytes each fit in the rest of the payload
+static bool CheckCount(const std::vector<char>& payload, std::size_t pos, uint64_t count, std::size_t elementSize)
+{
+    return count <= (payload.size() - pos) / elementSize;
+}
+
+static bool ReadBytes(const std::vector<char>& payload, std::size_t& pos, uint64_t size, std::vector<char>& bytesOut)
+{
+    if (payload.size() - pos < size)
+    {
+        return false;
+    }
+
+    bytesOut.assign(payload.begin() + pos, payload.begin() + pos + size);
+    pos += size;
+    return true;
+}
+
+// ------------------ Definitions of HSADispatchCapture ------------------------
+
+HSADispatchCapture::HSADispatchCapture() :
+    m_pendingSize(0),
+    m_isClosing(false),
+    m_writeFailed(false)
+{
+}
+
+HSADispatchCapture::~HSADispatchCapture()
+{
+    if (!Close())
+    {
+        std::cerr << "Error in HSADispatchCapture::~HSADispatchCapture(): Close() failed\n";
+    }
+}
+
+bool HSADispatchCapture::Open(const std::string& fileName)
+{
+    if (m_writer.joinable())
+    {
+        std::cerr << "Error in HSADispatchCapture::Open(): Please call Close() first before re-using it.\n";
+        return false;
+    }
+
+    m_file.open(fileName, std::ios::binary | std::ios::trunc);
+
+    if (!m_file.is_open())
+    {
+        std::cerr << "Error in HSADispatchCapture::Open(): Cannot open file \"" << fileName << "\"\n";
+        return false;
+    }
+
+    m_file.write(gs_CAPTURE_MAGIC, sizeof(gs_CAPTURE_MAGIC));
+
+    m_pendingSize = 0;
+    m_isClosing = false;
+    m_writeFailed = false;
+    m_codeObjectIds.clear();
+    m_writer = std::thread(&HSADispatchCapture::WriteRecords, this);
+
+    return m_file.good();
+}
+
+bool HSADispatchCapture::CaptureDispatch(HSAResourceManager&                       resourceManager,
+                                         hsa_kernel_dispatch_packet_t&             aql,
+                                         const std::vector<DispatchCaptureBuffer>& buffers)
+{
+    if (!m_writer.joinable())
+    {
+        std::cerr << "Error in HSADispatchCapture::CaptureDispatch(): Please call Open() first.\n";
+        return false;
+    }
+
+    const AQLInfo& aqlInfo = resourceManager.GetAqlInfo(aql);
+
+    if (0 == aqlInfo.m_codeObj.handle || aqlInfo.m_kernelSymbol.empty())
+    {
+        std::cerr << "Error in HSADispatchCapture::CaptureDispatch(): The aql packet was not created from a BRIG module.\n";
+        return false;
+    }
+
+    uint32_t codeObjectId = 0;
+
+    if (!CaptureCodeObject(aqlInfo.m_codeObj, codeObjectId))
+    {
+        std::cerr << "Error in HSADispatchCapture::CaptureDispatch(): CaptureCodeObject() failed.\n";
+        return false;
+    }
+
+    const HSAKernelArgBuffer& kernArgBuffer = aqlInfo.m_kernArgBuffer;
+    const char* pKernarg = reinterpret_cast<const char*>(kernArgBuffer.GetArgBufferPointer());
+    const uint64_t kernargSize = (nullptr == pKernarg) ? 0 : kernArgBuffer.GetBufferSize();
+    const uint64_t kernargStartOffset = kernArgBuffer.GetStartOffset();
+
+    std::size_t payloadSize = sizeof(uint32_t) * 3 + aqlInfo.m_kernelSymbol.size() + sizeof(aql) + sizeof(uint64_t) * 2 + kernargSize;
+
+    for (std::size_t i = 0; i < buffers.size(); ++i)
+    {
+        payloadSize += sizeof(uint64_t) + sizeof(uint32_t) * 2 + buffers[i].m_size;
+    }
+
+    // Find the kernel arguments pointing to each buffer
+    std::vector<std::vector<uint64_t> > argOffsets(buffers.size());
+
+    for (uint64_t offset = 0; offset + sizeof(uint64_t) <= kernargSize; offset += sizeof(uint64_t))
+    {
+        uint64_t argValue = 0;
+        memcpy(&argValue, pKernarg + offset, sizeof(argValue));
+
+        for (std::size_t i = 0; i < buffers.size(); ++i)
+        {
+            if (0 != argValue && argValue == reinterpret_cast<uint64_t>(buffers[i].m_pAddress))
+            {
+                argOffsets[i].push_back(offset);
+                payloadSize += sizeof(uint64_t);
+            }
+        }
+    }
+
+    std::vector<char> record;
+    BeginRecord(record, RECORD_DISPATCH, payloadSize);
+
+    AppendValue(record, codeObjectId);
+    AppendValue(record, static_cast<uint32_t>(aqlInfo.m_kernelSymbol.size()));
+    AppendBytes(record, aqlInfo.m_kernelSymbol.data(), aqlInfo.m_kernelSymbol.size());
+    AppendValue(record, aql);
+    AppendValue(record, kernargStartOffset);
+    AppendValue(record, kernargSize);
+    AppendBytes(record, pKernarg, kernargSize);
+    AppendValue(record, static_cast<uint32_t>(buffers.size()));
+
+    for (std::size_t i = 0; i < buffers.size(); ++i)
+    {
+        if (argOffsets[i].empty())
+        {
+            std::cout << "Warning in HSADispatchCapture::CaptureDispatch(): No kernel argument points to buffer " << i << ".\n";
+        }
+
+        AppendValue(record, static_cast<uint64_t>(buffers[i].m_size));
+        AppendValue(record, static_cast<uint32_t>(buffers[i].m_memoryKind));
+        AppendValue(record, static_cast<uint32_t>(argOffsets[i].size()));
+
+        for (std::size_t j = 0; j < argOffsets[i].size(); ++j)
+        {
+            AppendValue(record, argOffsets[i][j]);
+        }
+
+        if (CAPTURE_MEMORY_COARSE_LOCAL == buffers[i].m_memoryKind && 0 != buffers[i].m_size)
+        {
+            // Device local memory may not be host accessible
+            const std::size_t dataOffset = record.size();
+            record.resize(dataOffset + buffers[i].m_size);
+
+            if (!HSAResourceManager::CopyHSAMemory(&record[dataOffset], buffers[i].m_pAddress, buffers[i].m_size, false, resourceManager.GPUIndex()))
+            {
+                std::cerr << "Error in HSADispatchCapture::CaptureDispatch(): Cannot copy buffer " << i << " from the GPU.\n";
+                return false;
+            }
+        }
+        else
+        {
+            AppendBytes(record, buffers[i].m_pAddress, buffers[i].m_size);
+        }
+    }
+
+    PushRecord(record);
+
+    return true;
+}
+
+bool HSADispatchCapture::Close()
+{
+    if (!m_writer.joinable())
+    {
+        return true;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_isClosing = true;
+    }
+
+    m_changed.notify_all();
+    m_writer.join();
+
+    m_file.close();
+
+    bool ret = !m_writeFailed;
+
+    if (!ret)
+    {
+        std::cerr << "Error in HSADispatchCapture::Close(): Some captured dispatches could not be written.\n";
+    }
+
+    return ret;
+}
+
+bool HSADispatchCapture::CaptureCodeObject(const hsa_code_object_t& codeObj, uint32_t& codeObjectIdOut)
+{
+    // Several threads can capture dispatches at the same time
+    std::lock_guard<std::mutex> lock(m_codeObjectMutex);
+
+    std::unordered_map<uint64_t, uint32_t>::const_iterator iter = m_codeObjectIds.find(codeObj.handle);
+
+    if (m_codeObjectIds.end() != iter)
+    {
+        codeObjectIdOut = iter->second;
+        return true;
+    }
+
+    void* pSerialized = nullptr;
+    size_t serializedSize = 0;
+    hsa_callback_data_t callbackData = {0};
+    hsa_status_t status = hsa_code_object_serialize(codeObj,
+                                                    AllocateSerializedCodeObject_Callback,
+                                                    callbackData,
+                                                    nullptr,
+                                                    &pSerialized,
+                                                    &serializedSize);
+
+    if (!HSA_CHECK_STATUS(status) || nullptr == pSerialized)
+    {
+        std::cerr << "Error in HSADispatchCapture::CaptureCodeObject(): hsa_code_object_serialize() failed.\n";
+        return false;
+    }
+
+    const uint32_t codeObjectId = static_cast<uint32_t>(m_codeObjectIds.size());
+
+    std::vector<char> record;
+    BeginRecord(record, RECORD_CODE_OBJECT, sizeof(uint32_t) + serializedSize);
+    AppendValue(record, codeObjectId);
+    AppendBytes(record, pSerialized, serializedSize);
+    free(pSerialized);
+
+    PushRecord(record);
+
+    m_codeObjectIds[codeObj.handle] = codeObjectId;
+    codeObjectIdOut = codeObjectId;
+    return true;
+}
+
+void HSADispatchCapture::PushRecord(std::vector<char>& record)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    // Bound the memory held by the captured dispatches if the writer falls behind
+    while (0 != m_pendingSize && m_pendingSize + record.size() > gs_MAX_PENDING_CAPTURE_SIZE)
+    {
+        m_changed.wait(lock);
+    }
+
+    m_pendingSize += record.size();
+    m_records.push_back(std::vector<char>());
+    m_records.back().swap(record);
+
+    lock.unlock();
+    m_changed.notify_all();
+}
+
+void HSADispatchCapture::WriteRecords()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    while (true)
+    {
+        while (m_records.empty() && !m_isClosing)
+        {
+            m_changed.wait(lock);
+        }
+
+        if (m_records.empty())
+        {
+            break;
+        }
+
+        std::vector<char> record;
+        record.swap(m_records.front());
+        m_records.pop_front();
+
+        // Write without holding the lock, so that the application can keep capturing
+        lock.unlock();
+        m_file.write(record.data(), record.size());
+        bool isGood = m_file.good();
+        lock.lock();
+
+        m_writeFailed |= !isGood;
+        m_pendingSize -= record.size();
+        m_changed.notify_all();
+    }
+
+    m_file.flush();
+    m_writeFailed |= !m_file.good();
+}
+
+// ------------------ Definitions of DispatchCaptureReader ---------------------
+
+DispatchCaptureReader::DispatchCaptureReader() :
+    m_remainingSize(0),
+    m_failed(false)
+{
+}
+
+bool DispatchCaptureReader::Open(const std::string& fileName)
+{
+    m_file.open(fileName, std::ios::binary | std::ios::ate);
+
+    if (!m_file.is_open())
+    {
+        std::cerr << "Error in DispatchCaptureReader::Open(): Cannot open file \"" << fileName << "\"\n";
+        return false;
+    }
+
+    std::streamoff fileSize = m_file.tellg();
+    m_file.seekg(0);
+
+    if (fileSize < static_cast<std::streamoff>(sizeof(gs_CAPTURE_MAGIC)) || !m_file.good())
+    {
+        std::cerr << "Error in DispatchCaptureReader::Open(): \"" << fileName << "\" is not a dispatch capture file.\n";
+        return false;
+    }
+
+    char magic[sizeof(gs_CAPTURE_MAGIC)];
+    m_file.read(magic, sizeof(magic));
+
+    if (!m_file.good() || 0 != memcmp(magic, gs_CAPTURE_MAGIC, sizeof(magic)))
+    {
+        std::cerr << "Error in DispatchCaptureReader::Open(): \"" << fileName << "\" is not a dispatch capture file.\n";
+        return false;
+    }
+
+    m_codeObjects.clear();
+    m_remainingSize = static_cast<uint64_t>(fileSize) - sizeof(gs_CAPTURE_MAGIC);
+    m_failed = false;
+    return true;
+}
+
+bool DispatchCaptureReader::ReadDispatch(CapturedDispatch& dispatchOut)
+{
+    while (true)
+    {
+        if (m_failed)
+        {
+            return false;
+        }
+
+        // The end of the file is only valid between records
+        if (0 == m_remainingSize)
+        {
+            return false;
+        }
+
+        uint32_t type = 0;
+        uint64_t payloadSize = 0;
+
+        if (m_remainingSize < gs_RECORD_HEADER_SIZE)
+        {
+            std::cerr << "Error in DispatchCaptureReader::ReadDispatch(): The capture file is truncated in a record header.\n";
+            m_failed = true;
+            return false;
+        }
+
+        m_file.read(reinterpret_cast<char*>(&type), sizeof(type));
+        m_file.read(reinterpret_cast<char*>(&payloadSize), sizeof(payloadSize));
+        m_remainingSize -= gs_RECORD_HEADER_SIZE;
+
+        if (!m_file.good() || payloadSize > m_remainingSize)
+        {
+            std::cerr << "Error in DispatchCaptureReader::ReadDispatch(): The capture file is truncated, a record of "
+                      << payloadSize << " bytes has only " << m_remainingSize << " bytes left.\n";
+            m_failed = true;
+            return false;
+        }
+
+        std::vector<char> payload(payloadSize);
+        m_file.read(payload.data(), payloadSize);
+        m_remainingSize -= payloadSize;
+
+        if (!m_file.good())
+        {
+            std::cerr << "Error in DispatchCaptureReader::ReadDispatch(): Cannot read a record of the capture file.\n";
+            m_failed = true;
+            return false;
+        }
+
+        // Skip unknown records
+        if (RECORD_CODE_OBJECT != type && RECORD_DISPATCH != type)
+        {
+            continue;
+        }
+
+        std::size_t pos = 0;
+        uint32_t codeObjectId = 0;
+
+        if (!ReadValue(payload, pos, codeObjectId))
+        {
+            std::cerr << "Error in DispatchCaptureReader::ReadDispatch(): Invalid record.\n";
+            m_failed = true;
+            return false;
+        }
+
+        if (RECORD_CODE_OBJECT == type)
+        {
+            m_codeObjects[codeObjectId] = std::make_shared<const std::vector<char> >(payload.begin() + pos, payload.end());
+            continue;
+        }
+
+        std::unordered_map<uint32_t, std::shared_ptr<const std::vector<char> > >::const_iterator iter = m_codeObjects.find(codeObjectId);
+
+        if (m_codeObjects.end() == iter)
+        {
+            std::cerr << "Error in DispatchCaptureReader::ReadDispatch(): Dispatch of an unknown code object " << codeObjectId << ".\n";
+            m_failed = true;
+            return false;
+        }
+
+        dispatchOut.m_codeObjectId = codeObjectId;
+        dispatchOut.m_pCodeObject = iter->second;
+        dispatchOut.m_buffers.clear();
+
+        uint32_t symbolLength = 0;
+        uint64_t kernargSize = 0;
+        uint32_t bufferCount = 0;
+        std::vector<char> symbol;
+
+        bool ret = ReadValue(payload, pos, symbolLength) &&
+                   ReadBytes(payload, pos, symbolLength, symbol) &&
+                   ReadValue(payload, pos, dispatchOut.m_aql) &&
+                   ReadValue(payload, pos, dispatchOut.m_kernargStartOffset) &&
+                   ReadValue(payload, pos, kernargSize) &&
+                   ReadBytes(payload, pos, kernargSize, dispatchOut.m_kernarg) &&
+                   ReadValue(payload, pos, bufferCount) &&
+                   CheckCount(payload, pos, bufferCount, sizeof(uint64_t) + sizeof(uint32_t) * 2);
+
+        if (ret)
+        {
+            dispatchOut.m_buffers.reserve(bufferCount);
+        }
+
+        for (uint32_t i = 0; ret && i < bufferCount; ++i)
+        {
+            uint64_t bufferSize = 0;
+            uint32_t memoryKind = 0;
+            uint32_t argCount = 0;
+            dispatchOut.m_buffers.push_back(CapturedBuffer());
+            CapturedBuffer& buffer = dispatchOut.m_buffers.back();
+
+            ret = ReadValue(payload, pos, bufferSize) &&
+                  ReadValue(payload, pos, memoryKind) &&
+                  (CAPTURE_MEMORY_SYSTEM == memoryKind || CAPTURE_MEMORY_COARSE_LOCAL == memoryKind) &&
+                  ReadValue(payload, pos, argCount) &&
+                  CheckCount(payload, pos, argCount, sizeof(uint64_t)) &&
+                  CheckCount(payload, pos + argCount * sizeof(uint64_t), bufferSize, 1);
+
+            if (ret)
+            {
+                buffer.m_memoryKind = static_cast<CaptureMemoryKind>(memoryKind);
+                buffer.m_argOffsets.reserve(argCount);
+            }
+
+            for (uint32_t j = 0; ret && j < argCount; ++j)
+            {
+                uint64_t argOffset = 0;
+                ret = ReadValue(payload, pos, argOffset);
+                buffer.m_argOffsets.push_back(argOffset);
+            }
+
+            ret = ret && ReadBytes(payload, pos, bufferSize, buffer.m_data);
+        }
+
+        if (!ret)
+        {
+            std::cerr << "Error in DispatchCaptureReader::ReadDispatch(): Invalid dispatch record.\n";
+            m_failed = true;
+            return false;
+        }
+
+        dispatchOut.m_kernelSymbol.assign(symbol.begin(), symbol.end());
+        return true;
+    }
+}
+
+bool DispatchCaptureReader::Failed() const
+{
+    return m_failed;
+}
+
+// -----------------------------------------------------------------------------
+
+void BeginRecord(std::vector<char>& record, uint32_t type, std::size_t payloadSize)
+{
+    record.clear();
+    record.reserve(gs_RECORD_HEADER_SIZE + payloadSize);
+    AppendValue(record, type);
+    AppendValue(record, static_cast<uint64_t>(payloadSize));
+}
+
+void AppendBytes(std::vector<char>& record, const void* pData, std::size_t size)
+{
+    if (0 != size)
+    {
+        const char* pBytes = reinterpret_cast<const char*>(pData);
+        record.insert(record.end(), pBytes, pBytes + size);
+    }
+}
+
+hsa_status_t AllocateSerializedCodeObject_Callback(size_t size, hsa_callback_data_t data, void** pAddress)
+{
+    (void)data;
+
+    if (nullptr == pAddress)
+    {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+
+    *pAddress = malloc(size);
+    return (nullptr == *pAddress) ? HSA_STATUS_ERROR_OUT_OF_RESOURCES : HSA_STATUS_SUCCESS;
+}
+
+} // namespace AMDT
@@ -0,0 +1,215 @@
+//==============================================================================
+// Copyright (c) 2017 Advanced Micro Devices, Inc. All rights reserved.
+//
+/// \author AMD Developer Tools
+/// \file
+/// \brief  Capture kernel dispatches to a file, with their code object,
+///         kernel arguments and argument buffers, so that they can be
+///         replayed standalone.
+//==============================================================================
+#ifndef HSA_DISPATCH_CAPTURE_H_
+#define HSA_DISPATCH_CAPTURE_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>   // memset
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <hsa.h>
+
+#include "HSAResourceManager.h"
+
+namespace AMDT
+{
+
+/// Maximum number of captured bytes waiting to be written before CaptureDispatch() blocks
+static const std::size_t gs_MAX_PENDING_CAPTURE_SIZE = 256 * 1024 * 1024;
+
+/// \brief Memory a captured buffer was allocated in, the replay allocates the same kind
+enum CaptureMemoryKind
+{
+    CAPTURE_MEMORY_SYSTEM = 0,       ///< host memory, e.g. from HSAResourceManager::AllocateSysMemory()
+    CAPTURE_MEMORY_COARSE_LOCAL = 1  ///< device local memory, e.g. from HSAResourceManager::AllocateCoarseLocalMemory()
+};
+
+/// \brief A buffer referenced by a pointer kernel argument of a dispatch to be captured
+typedef struct DispatchCaptureBuffer
+{
+    // Address of the buffer, as passed in the kernel arguments
+    const void* m_pAddress;
+
+    // Size of the buffer in bytes
+    std::size_t m_size;
+
+    // Memory the buffer is allocated in, device local buffers are copied back from the GPU of the resource manager
+    CaptureMemoryKind m_memoryKind;
+
+    DispatchCaptureBuffer(const void* pAddress, std::size_t size, CaptureMemoryKind memoryKind = CAPTURE_MEMORY_SYSTEM) :
+        m_pAddress(pAddress), m_size(size), m_memoryKind(memoryKind)
+    {}
+} DispatchCaptureBuffer;
+
+/// \brief A buffer read back from a capture file
+typedef struct CapturedBuffer
+{
+    // Contents of the buffer when the dispatch was captured
+    std::vector<char> m_data;
+
+    // Offsets in the kernel argument block of the arguments pointing to the buffer
+    std::vector<uint64_t> m_argOffsets;
+
+    // Memory the buffer was allocated in
+    CaptureMemoryKind m_memoryKind;
+
+    CapturedBuffer() : m_memoryKind(CAPTURE_MEMORY_SYSTEM)
+    {}
+} CapturedBuffer;
+
+/// \brief A dispatch read back from a capture file
+typedef struct CapturedDispatch
+{
+    // Id of the code object in the capture file, shared by the dispatches of the same code object
+    uint32_t m_codeObjectId;
+
+    // Serialized code object
+    std::shared_ptr<const std::vector<char> > m_pCodeObject;
+
+    // Kernel entry point
+    std::string m_kernelSymbol;
+
+    // The captured AQL packet, kernel_object, kernarg_address and completion_signal are not valid
+    hsa_kernel_dispatch_packet_t m_aql;
+
+    // Start offset of the actual argument content in the kernel argument block
+    uint64_t m_kernargStartOffset;
+
+    // The whole kernel argument block
+    std::vector<char> m_kernarg;
+
+    // Buffers referenced by the kernel arguments
+    std::vector<CapturedBuffer> m_buffers;
+
+    CapturedDispatch() : m_codeObjectId(0), m_kernargStartOffset(0)
+    {
+        memset(&m_aql, 0, sizeof(m_aql));
+    }
+} CapturedDispatch;
+
+// -----------------------------------------------------------------------------
+
+/// \brief Write kernel dispatches to a capture file.
+///        The dispatch is snapshot in memory by CaptureDispatch() and written to the file by a
+///        background thread, so the captured application only pays for the memory copies.
+class HSADispatchCapture
+{
+public:
+    /// Constructor
+    HSADispatchCapture();
+
+    /// Destructor, will call Close()
+    ~HSADispatchCapture();
+
+    /// \brief Create the capture file and start the writer thread.
+    ///
+    /// \param[in] fileName The capture file
+    /// \return true if there is no error
+    bool Open(const std::string& fileName);
+
+    /// \brief Snapshot a dispatch, to be called before the aql packet is dispatched.
+    ///        The code object is stored once however many of its dispatches are captured.
+    ///        Several threads can capture dispatches at the same time.
+    ///        Kernel arguments holding the address of one of the buffers are patched to the
+    ///        address of the new buffer when the dispatch is replayed.
+    ///
+    /// \param[in] resourceManager The resource manager which created the aql packet from a BRIG module
+    /// \param[in] aql             The AQL packet with its kernel arguments set up
+    /// \param[in] buffers         The buffers referenced by the kernel arguments, with the memory they are allocated in
+    /// \return true if there is no error
+    bool CaptureDispatch(HSAResourceManager&                       resourceManager,
+                         hsa_kernel_dispatch_packet_t&             aql,
+                         const std::vector<DispatchCaptureBuffer>& buffers);
+
+    /// \brief Write the remaining captured dispatches and close the capture file.
+    ///
+    /// \return true if every captured dispatch was written
+    bool Close();
+
+private:
+    /// disable copy constructor
+    HSADispatchCapture(const HSADispatchCapture&);
+
+    /// disable assignment operator
+    HSADispatchCapture& operator=(const HSADispatchCapture&);
+
+    /// \brief Serialize a code object into a record, if it is not captured yet.
+    bool CaptureCodeObject(const hsa_code_object_t& codeObj, uint32_t& codeObjectIdOut);
+
+    /// \brief Hand a record over to the writer thread.
+    void PushRecord(std::vector<char>& record);
+
+    /// \brief Body of the writer thread.
+    void WriteRecords();
+
+    std::ofstream                          m_file;            ///< the capture file
+    std::thread                            m_writer;          ///< thread writing the records to m_file
+    std::mutex                             m_mutex;           ///< protect the members below
+    std::condition_variable                m_changed;         ///< notified when a record is pushed or written
+    std::deque<std::vector<char> >         m_records;         ///< records waiting to be written
+    std::size_t                            m_pendingSize;     ///< total size of m_records in bytes
+    bool                                   m_isClosing;       ///< tell the writer thread to exit once m_records is empty
+    bool                                   m_writeFailed;     ///< set by the writer thread if a write failed
+    std::mutex                             m_codeObjectMutex; ///< held while a code object is looked up and captured, so that
+                                                              ///< it is queued before the dispatches of any thread using it
+    std::unordered_map<uint64_t, uint32_t> m_codeObjectIds;   ///< id of each captured code object handle
+};
+
+// -----------------------------------------------------------------------------
+
+/// \brief Read back the dispatches of a capture file written by HSADispatchCapture
+class DispatchCaptureReader
+{
+public:
+    /// Constructor
+    DispatchCaptureReader();
+
+    /// \brief Open a capture file and check its header.
+    ///
+    /// \param[in] fileName The capture file
+    /// \return true if there is no error
+    bool Open(const std::string& fileName);
+
+    /// \brief Read the next dispatch.
+    ///
+    /// \param[out] dispatchOut The dispatch read
+    /// \return true if a dispatch was read, false at the end of the file or on error
+    bool ReadDispatch(CapturedDispatch& dispatchOut);
+
+    /// \brief Check whether reading stopped on an error rather than at the end of the file.
+    ///
+    /// \return true if the capture file is truncated or has an invalid record
+    bool Failed() const;
+
+private:
+    /// disable copy constructor
+    DispatchCaptureReader(const DispatchCaptureReader&);
+
+    /// disable assignment operator
+    DispatchCaptureReader& operator=(const DispatchCaptureReader&);
+
+    std::ifstream m_file;          ///< the capture file
+    uint64_t      m_remainingSize; ///< size of the capture file after the current read position
+    bool          m_failed;        ///< set when a truncated or invalid record is read
+    std::unordered_map<uint32_t, std::shared_ptr<const std::vector<char> > > m_codeObjects; ///< code objects read so far
+};
+
+} // namespace AMDT
+
+#endif // HSA_DISPATCH_CAPTURE_H_
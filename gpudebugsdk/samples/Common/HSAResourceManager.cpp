@@ -10,6 +10,11 @@
 
 #include <cstdlib>   // _putenv_s, _dupenv_s on Windows, setenv, unsetenv on Linux.
 #include <cstring>    // memset, memcpy
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <sstream>
 #include <string>
 #include <stdarg.h>
 #include <iostream>
@@ -29,23 +34,79 @@ typedef struct AgentList
     std::vector<AgentInfo> m_vecCPU;
 } AgentList;
 
+// Timing records filled in by DispatchTiming_Callback() as dispatches complete.
+struct DispatchTimingLog
+{
+    std::mutex m_mutex;
+    std::condition_variable m_completed;
+    std::size_t m_pendingCount;
+    std::vector<DispatchTiming> m_timings;
+
+    DispatchTimingLog() : m_pendingCount(0) {}
+};
+
+// Local struct of a dispatch in flight, DispatchTiming_Callback() gets a heap allocated
+// std::shared_ptr to it, so that the dispatching thread can still set m_packetId if the
+// handler runs first.
+typedef struct PendingDispatchTiming
+{
+    std::shared_ptr<DispatchTimingLog> m_pLog;
+    hsa_agent_t m_device;
+    hsa_signal_t m_completionSignal;
+    bool m_hasGpuTimestamps;
+    std::atomic<uint64_t> m_packetId;   ///< set once the queue slot is reserved, after the handler is registered
+    DispatchTiming m_timing;
+
+    PendingDispatchTiming() : m_hasGpuTimestamps(false), m_packetId(0) {}
+} PendingDispatchTiming;
+
 static bool gs_bVerbosePrint = false;
 
+// Frequency of the HSA system timestamp, in ticks per second, queried in InitRuntime()
+static uint64_t gs_timestampFrequency = 0;
+static const uint64_t gs_NS_PER_SECOND = 1000000000;
+
 // Static local function declaration
 static bool         InitAQL(hsa_kernel_dispatch_packet_t& aqlPacket);
 static hsa_status_t FindMemRegions_Callback(hsa_region_t region, void* data);
 static hsa_status_t QueryDevice_Callback(hsa_agent_t agent, void* pData);
-
-HSAFinalizer HSAResourceManager::ms_finalizer;
-uint16_t     HSAResourceManager::ms_hsaCount = 0;
-AgentInfo    HSAResourceManager::ms_gpu;
-AgentInfo    HSAResourceManager::ms_cpu;
-bool         HSAResourceManager::ms_hasRuntime = false;
-bool         HSAResourceManager::ms_profilingEnabled = false;
-hsa_queue_t* HSAResourceManager::ms_pQueue = nullptr;
+static bool         DispatchTiming_Callback(hsa_signal_value_t value, void* pData);
+static uint64_t     TimestampToNs(uint64_t ticks);
+static uint64_t     HostTimestamp();
+static unsigned int ThreadQueueSlot();
+static uint64_t     ReserveQueueSlots(hsa_queue_t* pQueue, bool isMultiProducer, uint32_t count);
+static void         WritePacketBody(hsa_queue_t* pQueue, uint64_t index, const hsa_kernel_dispatch_packet_t& aql);
+static void         PublishPacketHeader(hsa_queue_t* pQueue, uint64_t index, const hsa_kernel_dispatch_packet_t& aql);
+
+HSAFinalizer              HSAResourceManager::ms_finalizer;
+uint16_t                  HSAResourceManager::ms_hsaCount = 0;
+std::vector<AgentInfo>    HSAResourceManager::ms_gpus;
+AgentInfo                 HSAResourceManager::ms_cpu;
+unsigned int              HSAResourceManager::ms_defaultGpuIndex = 0;
+bool                      HSAResourceManager::ms_hasRuntime = false;
+std::vector<DeviceQueues> HSAResourceManager::ms_queues;
+
+// Returned by the accessors when the GPU index is not valid.
+static const AgentInfo gs_NO_GPU_INFO;
+static hsa_queue_t* const gs_pNO_QUEUE = nullptr;
 
 // ------------------------------------- Public Functions -------------------------------------
-HSAResourceManager::HSAResourceManager()
+HSAResourceManager::HSAResourceManager() :
+    m_gpuIndex(ms_defaultGpuIndex),
+    m_queueSelectionPolicy(QUEUE_SELECTION_ROUND_ROBIN),
+    m_nextQueueIndex(0),
+    m_dispatchTimingEnabled(false),
+    m_pDispatchTimingLog(std::make_shared<DispatchTimingLog>())
+{
+    ms_hsaCount++;
+}
+
+HSAResourceManager::HSAResourceManager(unsigned int gpuIndex) :
+    m_gpuIndex(gpuIndex),
+    m_queueSelectionPolicy(QUEUE_SELECTION_ROUND_ROBIN),
+    m_nextQueueIndex(0),
+    m_dispatchTimingEnabled(false),
+    m_pDispatchTimingLog(std::make_shared<DispatchTimingLog>())
 {
     ms_hsaCount++;
 }
@@ -120,26 +181,33 @@ bool HSAResourceManager::InitRuntime(bool verbosePrint, unsigned int gpuIndex)
             return false;
         }
 
-        // Choose the specified GPU agent
-        if (gpuIndex < agentList.m_vecGPU.size())
-        {
-            ms_gpu = agentList.m_vecGPU[gpuIndex];
-        }
-        else
-        {
-            ms_gpu = agentList.m_vecGPU[0];
-        }
+        // Keep all the GPU agents, the specified one is used by default
+        ms_gpus = agentList.m_vecGPU;
+        ms_queues.assign(ms_gpus.size(), DeviceQueues());
+        ms_defaultGpuIndex = (gpuIndex < ms_gpus.size()) ? gpuIndex : 0;
 
         // Choose the first agent from the agent vector.
         ms_cpu = agentList.m_vecCPU[0];
 
         // Find all memory region
-        status = hsa_agent_iterate_regions(ms_gpu.m_device, FindMemRegions_Callback, &ms_gpu);
-        ret &= HSA_CHECK_STATUS(status);
+        for (std::size_t i = 0; i < ms_gpus.size(); ++i)
+        {
+            status = hsa_agent_iterate_regions(ms_gpus[i].m_device, FindMemRegions_Callback, &ms_gpus[i]);
+            ret &= HSA_CHECK_STATUS(status);
+        }
 
         status = hsa_agent_iterate_regions(ms_cpu.m_device, FindMemRegions_Callback, &ms_cpu);
         ret &= HSA_CHECK_STATUS(status);
 
+        // The GPU dispatch times and the host times of the timing records are in this clock domain
+        status = hsa_system_get_info(HSA_SYSTEM_INFO_TIMESTAMP_FREQUENCY, &gs_timestampFrequency);
+
+        if (!HSA_CHECK_STATUS(status) || 0 == gs_timestampFrequency)
+        {
+            std::cerr << "Error in HSAResourceManager::InitRuntime(): Cannot query the system timestamp frequency.\n";
+            ret &= false;
+        }
+
         ms_hasRuntime = true;
     }
 
@@ -237,58 +305,95 @@ bool HSAResourceManager::GetHsaVersion(uint16_t& major, uint16_t& minor)
 }
 
 bool HSAResourceManager::CreateDefaultQueue(bool enableKernelTimestamps)
+{
+    return CreateDeviceQueue(ms_defaultGpuIndex, enableKernelTimestamps);
+}
+
+bool HSAResourceManager::CreateDeviceQueue(unsigned int gpuIndex, bool enableKernelTimestamps)
+{
+    return CreateDeviceQueues(gpuIndex, 1, false, enableKernelTimestamps);
+}
+
+bool HSAResourceManager::CreateDeviceQueues(unsigned int gpuIndex, unsigned int queueCount, bool multiProducer, bool enableKernelTimestamps)
 {
     bool ret = true;
 
-    if (!DestroyQueue())
+    if (gpuIndex >= ms_gpus.size())
     {
-        ret = false;
-        std::cerr << "Error in CreateDefaultQueue(): Destroying previous existing queue failed\n";
-        return ret;
+        std::cerr << "Error in HSAResourceManager::CreateDeviceQueues(): Invalid GPU index " << gpuIndex << "\n";
+        return false;
     }
 
-    uint32_t queueSize = 0;
-    hsa_status_t status = hsa_agent_get_info(ms_gpu.m_device, HSA_AGENT_INFO_QUEUE_MAX_SIZE, &queueSize);
+    if (0 == queueCount)
+    {
+        std::cerr << "Error in HSAResourceManager::CreateDeviceQueues(): At least one queue is needed\n";
+        return false;
+    }
 
-    if (!HSA_CHECK_STATUS(status))
+    if (!DestroyDeviceQueue(gpuIndex))
     {
-        std::cerr << "Error in HSAResourceManager::CreateDefaultQueue(): Get queue max size failed.\n";
         ret = false;
+        std::cerr << "Error in CreateDeviceQueues(): Destroying previous existing queue failed\n";
+        return ret;
     }
 
-    ms_gpu.m_maxQueueSize = queueSize;
+    AgentInfo& gpu = ms_gpus[gpuIndex];
+    DeviceQueues& deviceQueues = ms_queues[gpuIndex];
 
-    status = hsa_queue_create(ms_gpu.m_device,                 // HSA agent
-                              queueSize,              // Number of packets the queue is expected to hold
-                              HSA_QUEUE_TYPE_SINGLE,  // Type of the queue
-                              nullptr,                // callback related to the queue. No specific requirement so it should be nullptr.
-                              nullptr,                // Data that is passed to callback. nullptr because no callback here.
-                              UINT32_MAX,             // Private segment size. Hint indicating the maximum expected usage per work item. No particular value required, so it should be UINT32_MAX
-                              UINT32_MAX,             // Group segment size. Also no particular value required.
-                              &ms_pQueue);            // The queue we want to create.
+    uint32_t queueSize = 0;
+    hsa_status_t status = hsa_agent_get_info(gpu.m_device, HSA_AGENT_INFO_QUEUE_MAX_SIZE, &queueSize);
 
-    if (!HSA_CHECK_STATUS(status) || nullptr == ms_pQueue)
+    if (!HSA_CHECK_STATUS(status))
     {
-        std::cerr << "Error in HSAResourceManager::CreateDefaultQueue(): Create queue failed.\n";
+        std::cerr << "Error in HSAResourceManager::CreateDeviceQueues(): Get queue max size failed.\n";
         ret = false;
     }
 
-    ms_profilingEnabled = enableKernelTimestamps;
+    gpu.m_maxQueueSize = queueSize;
+    deviceQueues.m_isMultiProducer = multiProducer;
+    deviceQueues.m_profilingEnabled = enableKernelTimestamps;
 
-    if (enableKernelTimestamps)
+    for (unsigned int i = 0; ret && i < queueCount; ++i)
     {
-        status = hsa_amd_profiling_set_profiler_enabled(ms_pQueue, 1);
+        hsa_queue_t* pQueue = nullptr;
+        status = hsa_queue_create(gpu.m_device,           // HSA agent
+                                  queueSize,              // Number of packets the queue is expected to hold
+                                  multiProducer ? HSA_QUEUE_TYPE_MULTI : HSA_QUEUE_TYPE_SINGLE,  // Type of the queue
+                                  nullptr,                // callback related to the queue. No specific requirement so it should be nullptr.
+                                  nullptr,                // Data that is passed to callback. nullptr because no callback here.
+                                  UINT32_MAX,             // Private segment size. Hint indicating the maximum expected usage per work item. No particular value required, so it should be UINT32_MAX
+                                  UINT32_MAX,             // Group segment size. Also no particular value required.
+                                  &pQueue);               // The queue we want to create.
 
-        if (!HSA_CHECK_STATUS(status) || nullptr == ms_pQueue)
+        if (!HSA_CHECK_STATUS(status) || nullptr == pQueue)
         {
-            std::cerr << "Error in HSAResourceManager::CreateDefaultQueue(): hsa_amd_profiling_set_profiler_enabled() failed.\n";
+            std::cerr << "Error in HSAResourceManager::CreateDeviceQueues(): Create queue " << i << " failed.\n";
             ret = false;
+            break;
+        }
+
+        deviceQueues.m_queues.push_back(pQueue);
+
+        if (enableKernelTimestamps)
+        {
+            status = hsa_amd_profiling_set_profiler_enabled(pQueue, 1);
+
+            if (!HSA_CHECK_STATUS(status))
+            {
+                std::cerr << "Error in HSAResourceManager::CreateDeviceQueues(): hsa_amd_profiling_set_profiler_enabled() failed.\n";
+                ret = false;
+            }
         }
     }
 
     return ret;
 }
 
+void HSAResourceManager::SetQueueSelectionPolicy(QueueSelectionPolicy policy)
+{
+    m_queueSelectionPolicy = policy;
+}
+
 bool HSAResourceManager::SetQueue(hsa_queue_t* pQueue)
 {
     bool ret = true;
@@ -300,7 +405,17 @@ bool HSAResourceManager::SetQueue(hsa_queue_t* pQueue)
         return ret;
     }
 
-    ms_pQueue = pQueue;
+    if (ms_defaultGpuIndex < ms_queues.size())
+    {
+        ms_queues[ms_defaultGpuIndex].m_queues.assign(1, pQueue);
+        ms_queues[ms_defaultGpuIndex].m_isMultiProducer = false;
+        ms_queues[ms_defaultGpuIndex].m_profilingEnabled = false;
+    }
+    else
+    {
+        std::cerr << "Error in SetQueue(): There is no GPU device\n";
+        ret = false;
+    }
 
     return ret;
 };
@@ -362,14 +477,14 @@ bool HSAResourceManager::CreateAQLPacketFromBrig(
             std::cerr << "executable fail to create.\n";
         }
 
-        m_aqlInfos[&aqlPacketOut].m_executable = hsaExecutable;
+        AqlInfo(aqlPacketOut).m_executable = hsaExecutable;
 
         if (0 == codeObj.handle)
         {
             std::cerr << "codeObj fail to create.\n";
         }
 
-        m_aqlInfos[&aqlPacketOut].m_codeObj = codeObj;
+        AqlInfo(aqlPacketOut).m_codeObj = codeObj;
 
     }
 
@@ -380,12 +495,12 @@ bool HSAResourceManager::CreateAQLPacketFromBrig(
         return false;
     }
 
-    if (bCreateSignal && 0 == m_aqlInfos[&aqlPacketOut].m_completionSignal.handle)
+    if (bCreateSignal && 0 == AqlInfo(aqlPacketOut).m_completionSignal.handle)
     {
         std::cerr << "completion_signal fail in aqlInfo.\n";
     }
 
-    if (nullptr == m_aqlInfos[&aqlPacketOut].m_kernArgBuffer.GetArgBufferPointer())
+    if (nullptr == AqlInfo(aqlPacketOut).m_kernArgBuffer.GetArgBufferPointer())
     {
         std::cerr << "kernarg buffer fail in aqlInfo.\n";
     }
@@ -414,11 +529,12 @@ bool HSAResourceManager::CreateAQLFromExecutable(
         return false;
     }
 
-    m_aqlInfos[&aql].m_executable = hsaExecutable;
+    AqlInfo(aql).m_executable = hsaExecutable;
+    AqlInfo(aql).m_kernelSymbol = kernelSymbol;
 
     // Get symbol handle
     hsa_executable_symbol_t symbolOffset;
-    hsa_status_t status = hsa_executable_get_symbol(hsaExecutable, nullptr, kernelSymbol.c_str(), ms_gpu.m_device, 0, &symbolOffset);
+    hsa_status_t status = hsa_executable_get_symbol(hsaExecutable, nullptr, kernelSymbol.c_str(), GPUInfo(m_gpuIndex).m_device, 0, &symbolOffset);
 
     if (!HSA_CHECK_STATUS(status))
     {
@@ -457,7 +573,7 @@ bool HSAResourceManager::CreateAQLFromExecutable(
         return false;
     }
 
-    ret = m_aqlInfos[&aql].m_kernArgBuffer.AllocateBuffer(kernArgSize, kernargOffset);
+    ret = AqlInfo(aql).m_kernArgBuffer.AllocateBuffer(m_gpuIndex, kernArgSize, kernargOffset);
 
     if (!ret)
     {
@@ -465,7 +581,7 @@ bool HSAResourceManager::CreateAQLFromExecutable(
         return false;
     }
 
-    aql.kernarg_address = m_aqlInfos[&aql].m_kernArgBuffer.GetArgBufferPointer();
+    aql.kernarg_address = AqlInfo(aql).m_kernArgBuffer.GetArgBufferPointer();
 
     if (bCreateSignal)
     {
@@ -478,7 +594,7 @@ bool HSAResourceManager::CreateAQLFromExecutable(
         }
     }
 
-    m_aqlInfos[&aql].m_completionSignal = aql.completion_signal;
+    AqlInfo(aql).m_completionSignal = aql.completion_signal;
 
     return true;
 }
@@ -535,7 +651,7 @@ bool HSAResourceManager::Finalize(const void*              pBRIG,
 
     // Finalize hsail program --------------------------------------------------------
     hsa_isa_t isa;
-    status = hsa_agent_get_info(ms_gpu.m_device, HSA_AGENT_INFO_ISA, &isa);
+    status = hsa_agent_get_info(GPUInfo(m_gpuIndex).m_device, HSA_AGENT_INFO_ISA, &isa);
 
     if (!HSA_CHECK_STATUS(status))
     {
@@ -573,9 +689,41 @@ bool HSAResourceManager::Finalize(const void*              pBRIG,
 
     program.handle = 0;
 
+    return LoadExecutable(hsaProfile, codeObjOut, executableOut);
+}
+
+bool HSAResourceManager::CreateExecutableFromCodeObject(
+    const void*             pSerializedCodeObj,
+    const std::size_t       size,
+          hsa_executable_t& executableOut)
+{
+    if (nullptr == pSerializedCodeObj || 0 == size)
+    {
+        std::cerr << "Error in HSAResourceManager::CreateExecutableFromCodeObject(): Input code object is empty.\n";
+        return false;
+    }
+
+    hsa_code_object_t codeObj = {0};
+    hsa_status_t status = hsa_code_object_deserialize(const_cast<void*>(pSerializedCodeObj), size, nullptr, &codeObj);
+
+    if (!HSA_CHECK_STATUS(status))
+    {
+        std::cerr << "Error in HSAResourceManager::CreateExecutableFromCodeObject(): hsa_code_object_deserialize() failed.\n";
+        return false;
+    }
+
+    m_codeObjSet.insert(codeObj.handle);
+
+    return LoadExecutable(GPUInfo(m_gpuIndex).m_profile, codeObj, executableOut);
+}
+
+bool HSAResourceManager::LoadExecutable(const hsa_profile_t      hsaProfile,
+                                        const hsa_code_object_t& codeObj,
+                                              hsa_executable_t&  executableOut)
+{
     // Create executable
-    status = hsa_executable_create(
-                 hsaProfile, HSA_EXECUTABLE_STATE_UNFROZEN, "", &executableOut);
+    hsa_status_t status = hsa_executable_create(
+                              hsaProfile, HSA_EXECUTABLE_STATE_UNFROZEN, "", &executableOut);
 
     if (!HSA_CHECK_STATUS(status))
     {
@@ -586,7 +734,7 @@ bool HSAResourceManager::Finalize(const void*              pBRIG,
     m_executableSet.insert(executableOut.handle);
 
     // Load code object.
-    status = hsa_executable_load_code_object(executableOut, ms_gpu.m_device, codeObjOut, nullptr);
+    status = hsa_executable_load_code_object(executableOut, GPUInfo(m_gpuIndex).m_device, codeObj, nullptr);
 
     if (!HSA_CHECK_STATUS(status))
     {
@@ -617,27 +765,28 @@ bool HSAResourceManager::CopyKernelDispatchPacket(
         return false;
     }
 
-    m_aqlInfos[&aqlPacketOut].m_completionSignal = m_aqlInfos[&aqlPacket].m_completionSignal;
-    m_aqlInfos[&aqlPacketOut].m_executable = m_aqlInfos[&aqlPacket].m_executable;
-    m_aqlInfos[&aqlPacketOut].m_codeObj = m_aqlInfos[&aqlPacket].m_codeObj;
+    AqlInfo(aqlPacketOut).m_completionSignal = AqlInfo(aqlPacket).m_completionSignal;
+    AqlInfo(aqlPacketOut).m_executable = AqlInfo(aqlPacket).m_executable;
+    AqlInfo(aqlPacketOut).m_codeObj = AqlInfo(aqlPacket).m_codeObj;
+    AqlInfo(aqlPacketOut).m_kernelSymbol = AqlInfo(aqlPacket).m_kernelSymbol;
 
     if (!bCopySignal)
     {
         aqlPacketOut.completion_signal.handle = 0;
-        m_aqlInfos[&aqlPacketOut].m_completionSignal.handle = 0;
+        AqlInfo(aqlPacketOut).m_completionSignal.handle = 0;
     }
 
-    const HSAKernelArgBuffer& origBuff = m_aqlInfos[&aqlPacket].m_kernArgBuffer;
+    const HSAKernelArgBuffer& origBuff = AqlInfo(aqlPacket).m_kernArgBuffer;
     if (origBuff.GetArgBufferPointer() != nullptr && origBuff.GetBufferSize() != 0)
     {
-        bool ret = m_aqlInfos[&aqlPacketOut].m_kernArgBuffer.AllocateBuffer(origBuff.GetBufferSize(), origBuff.GetStartOffset());
+        bool ret = AqlInfo(aqlPacketOut).m_kernArgBuffer.AllocateBuffer(m_gpuIndex, origBuff.GetBufferSize(), origBuff.GetStartOffset());
         if (!ret)
         {
             std::cerr << "Error in HSAResourceManager::CopyKernelDispatchPacket(): Allocating kernel arg buffer fail.\n";
             return false;
         }
 
-        aqlPacketOut.kernarg_address = m_aqlInfos[&aqlPacketOut].m_kernArgBuffer.GetArgBufferPointer();
+        aqlPacketOut.kernarg_address = AqlInfo(aqlPacketOut).m_kernArgBuffer.GetArgBufferPointer();
     }
 
     return true;
@@ -655,9 +804,10 @@ bool HSAResourceManager::CopyKernelDispatchPacket(
         return false;
     }
 
-    m_aqlInfos[&aqlPacketOut].m_completionSignal = m_aqlInfos[&aqlPacket].m_completionSignal;
-    m_aqlInfos[&aqlPacketOut].m_executable = m_aqlInfos[&aqlPacket].m_executable;
-    m_aqlInfos[&aqlPacketOut].m_codeObj = m_aqlInfos[&aqlPacket].m_codeObj;
+    AqlInfo(aqlPacketOut).m_completionSignal = AqlInfo(aqlPacket).m_completionSignal;
+    AqlInfo(aqlPacketOut).m_executable = AqlInfo(aqlPacket).m_executable;
+    AqlInfo(aqlPacketOut).m_codeObj = AqlInfo(aqlPacket).m_codeObj;
+    AqlInfo(aqlPacketOut).m_kernelSymbol = AqlInfo(aqlPacket).m_kernelSymbol;
 
     if (!bCopySignal)
     {
@@ -665,19 +815,19 @@ bool HSAResourceManager::CopyKernelDispatchPacket(
     }
     else
     {
-        m_aqlInfos[&aqlPacketOut].m_completionSignal = m_aqlInfos[&aqlPacket].m_completionSignal;
+        AqlInfo(aqlPacketOut).m_completionSignal = AqlInfo(aqlPacket).m_completionSignal;
     }
 
     if (!bCopyKernArgAddr)
     {
-        const HSAKernelArgBuffer& origBuff = m_aqlInfos[&aqlPacket].m_kernArgBuffer;
-        bool ret = m_aqlInfos[&aqlPacketOut].m_kernArgBuffer.AllocateBuffer(origBuff.GetBufferSize(), origBuff.GetStartOffset());
+        const HSAKernelArgBuffer& origBuff = AqlInfo(aqlPacket).m_kernArgBuffer;
+        bool ret = AqlInfo(aqlPacketOut).m_kernArgBuffer.AllocateBuffer(m_gpuIndex, origBuff.GetBufferSize(), origBuff.GetStartOffset());
         if (!ret)
         {
             std::cerr << "Error in HSAResourceManager::CopyKernelDispatchPacket(): Allocating kernel arg buffer fail.\n";
             return false;
         }
-        aqlPacketOut.kernarg_address = m_aqlInfos[&aqlPacketOut].m_kernArgBuffer.GetArgBufferPointer();
+        aqlPacketOut.kernarg_address = AqlInfo(aqlPacketOut).m_kernArgBuffer.GetArgBufferPointer();
     }
 
     return true;
@@ -685,12 +835,12 @@ bool HSAResourceManager::CopyKernelDispatchPacket(
 
 bool HSAResourceManager::AppendKernelArgs(const void* pAddr, const std::size_t size, hsa_kernel_dispatch_packet_t& aql)
 {
-    return m_aqlInfos[&aql].m_kernArgBuffer.AppendKernelArgs(pAddr, size);
+    return AqlInfo(aql).m_kernArgBuffer.AppendKernelArgs(pAddr, size);
 }
 
 bool HSAResourceManager::RegisterKernelArgsBuffer(hsa_kernel_dispatch_packet_t& aql)
 {
-    aql.kernarg_address = m_aqlInfos[&aql].m_kernArgBuffer.GetArgBufferPointer();
+    aql.kernarg_address = AqlInfo(aql).m_kernArgBuffer.GetArgBufferPointer();
 
     if (nullptr == aql.kernarg_address)
     {
@@ -703,7 +853,7 @@ bool HSAResourceManager::RegisterKernelArgsBuffer(hsa_kernel_dispatch_packet_t&
 
 bool HSAResourceManager::DeregisterKernelArgsBuffer(hsa_kernel_dispatch_packet_t& aql)
 {
-    bool ret = m_aqlInfos[&aql].m_kernArgBuffer.DestroyBuffer();
+    bool ret = AqlInfo(aql).m_kernArgBuffer.DestroyBuffer();
 
     aql.kernarg_address = nullptr;
 
@@ -712,34 +862,119 @@ bool HSAResourceManager::DeregisterKernelArgsBuffer(hsa_kernel_dispatch_packet_t
 
 bool HSAResourceManager::Dispatch(hsa_kernel_dispatch_packet_t& aql)
 {
-    if (nullptr == ms_pQueue)
+    return DispatchBatch(&aql, 1);
+}
+
+bool HSAResourceManager::DispatchBatch(hsa_kernel_dispatch_packet_t* pAqlPackets, std::size_t count)
+{
+    bool isMultiProducer = false;
+    hsa_queue_t* pQueue = SelectQueue(isMultiProducer);
+
+    if (nullptr == pQueue)
     {
         std::cerr << "No queue!\n";
         return false;
     }
 
-    // Verify if we have register the kernel args buffer.
-    // Assumming we have only one kernel in the application.
-    if (nullptr != m_aqlInfos[&aql].m_kernArgBuffer.GetArgBufferPointer()
-        && nullptr == aql.kernarg_address)
+    if (nullptr == pAqlPackets)
+    {
+        std::cerr << "Error in HSAResourceManager::DispatchBatch(): No aql packet.\n";
+        return false;
+    }
+
+    for (std::size_t i = 0; i < count; ++i)
     {
-        this->RegisterKernelArgsBuffer(aql);
+        hsa_kernel_dispatch_packet_t& aql = pAqlPackets[i];
+
+        // Verify if we have register the kernel args buffer.
+        // Assumming we have only one kernel in the application.
+        // Only look the aql packet up, other threads may be dispatching concurrently.
+        if (nullptr == aql.kernarg_address)
+        {
+            const AQLInfo* pAqlInfo = FindAqlInfo(aql);
+
+            if (nullptr != pAqlInfo && nullptr != pAqlInfo->m_kernArgBuffer.GetArgBufferPointer())
+            {
+                this->RegisterKernelArgsBuffer(aql);
+            }
+        }
     }
 
-    const uint32_t& queueSize = ms_pQueue->size;
-    const uint32_t queueMask = queueSize - 1;
+    // Timing records of the current batch, registered before the slots are reserved
+    std::vector<std::shared_ptr<PendingDispatchTiming> > pendingTimings;
+
+    for (std::size_t first = 0; first < count; first += pQueue->size)
+    {
+        // A batch cannot wait for more slots than the queue has
+        const uint32_t batchSize = static_cast<uint32_t>((count - first < pQueue->size) ? count - first : pQueue->size);
+
+        // Register the timing handlers first, so that only the packet bodies are written
+        // between the reservation of the slots and the publication of their headers
+        if (m_dispatchTimingEnabled)
+        {
+            pendingTimings.assign(batchSize, std::shared_ptr<PendingDispatchTiming>());
+
+            for (uint32_t i = 0; i < batchSize; ++i)
+            {
+                if (!RegisterDispatchTiming(pAqlPackets[first + i], pQueue, pendingTimings[i]))
+                {
+                    std::cerr << "Error in HSAResourceManager::DispatchBatch(): RegisterDispatchTiming() failed, no timing record for this dispatch.\n";
+                }
+            }
+        }
 
-    // Write to queue
-    uint64_t index = hsa_queue_load_write_index_relaxed(ms_pQueue);
-    ((hsa_kernel_dispatch_packet_t*)(ms_pQueue->base_address))[index & queueMask] = aql;
-    hsa_queue_store_write_index_relaxed(ms_pQueue, index + 1);
+        uint64_t index = ReserveQueueSlots(pQueue, isMultiProducer, batchSize);
 
-    // Ring doorbell.
-    hsa_signal_store_release(ms_pQueue->doorbell_signal, static_cast<hsa_signal_value_t>(index));
+        for (uint32_t i = 0; i < batchSize; ++i)
+        {
+            if (m_dispatchTimingEnabled && nullptr != pendingTimings[i])
+            {
+                SetDispatchTimingPacketId(*pendingTimings[i], index + i);
+            }
+
+            WritePacketBody(pQueue, index + i, pAqlPackets[first + i]);
+        }
+
+        // Publish the headers in order, the packet processor only looks at a slot once its header is valid
+        for (uint32_t i = 0; i < batchSize; ++i)
+        {
+            PublishPacketHeader(pQueue, index + i, pAqlPackets[first + i]);
+        }
+
+        // Ring doorbell once for the whole batch.
+        hsa_signal_store_release(pQueue->doorbell_signal, static_cast<hsa_signal_value_t>(index + batchSize - 1));
+    }
 
     return true;
 }
 
+hsa_queue_t* HSAResourceManager::SelectQueue(bool& isMultiProducerOut)
+{
+    if (m_gpuIndex >= ms_queues.size() || ms_queues[m_gpuIndex].m_queues.empty())
+    {
+        return nullptr;
+    }
+
+    const DeviceQueues& deviceQueues = ms_queues[m_gpuIndex];
+    const std::size_t queueCount = deviceQueues.m_queues.size();
+    std::size_t queueIndex = 0;
+
+    if (1 < queueCount)
+    {
+        if (QUEUE_SELECTION_THREAD_AFFINITY == m_queueSelectionPolicy)
+        {
+            queueIndex = ThreadQueueSlot() % queueCount;
+        }
+        else
+        {
+            queueIndex = m_nextQueueIndex.fetch_add(1, std::memory_order_relaxed) % queueCount;
+        }
+    }
+
+    isMultiProducerOut = deviceQueues.m_isMultiProducer;
+    return deviceQueues.m_queues[queueIndex];
+}
+
 bool HSAResourceManager::WaitForCompletion(hsa_signal_t& completionSignal, uint64_t timeout, bool outputTimingData)
 {
     bool ret = true;
@@ -755,24 +990,117 @@ bool HSAResourceManager::WaitForCompletion(hsa_signal_t& completionSignal, uint6
         ret = false;
     }
 
-    if (outputTimingData && ms_profilingEnabled)
+    if (outputTimingData && m_gpuIndex < ms_queues.size() && ms_queues[m_gpuIndex].m_profilingEnabled)
     {
         hsa_amd_profiling_dispatch_time_t dispatch_times;
         dispatch_times.start = 0;
         dispatch_times.end = 0;
-        hsa_status_t status = hsa_amd_profiling_get_dispatch_time(ms_gpu.m_device, completionSignal, &dispatch_times);
+        hsa_status_t status = hsa_amd_profiling_get_dispatch_time(GPUInfo(m_gpuIndex).m_device, completionSignal, &dispatch_times);
 
         if (!HSA_CHECK_STATUS(status))
         {
             std::cerr << "Error in HSAResourceManager::WaitForCompletion(): hsa_amd_profiling_get_dispatch_time() failed.\n";
         }
 
-        std::cout << "Kernel dispatch executed in " << double((dispatch_times.end - dispatch_times.start) / 1e6) << " milliseconds.\n";
+        std::cout << "Kernel dispatch executed in " << double(TimestampToNs(dispatch_times.end - dispatch_times.start) / 1e6) << " milliseconds.\n";
     }
 
     return ret;
 }
 
+void HSAResourceManager::EnableDispatchTiming(bool enable)
+{
+    m_dispatchTimingEnabled = enable;
+}
+
+bool HSAResourceManager::RegisterDispatchTiming(const hsa_kernel_dispatch_packet_t& aql, const hsa_queue_t* pQueue, std::shared_ptr<PendingDispatchTiming>& pPendingOut)
+{
+    pPendingOut.reset();
+
+    if (0 == aql.completion_signal.handle)
+    {
+        std::cerr << "Error in HSAResourceManager::RegisterDispatchTiming(): The aql packet has no completion signal.\n";
+        return false;
+    }
+
+    // The handler would run at once and time nothing
+    if (0 == hsa_signal_load_relaxed(aql.completion_signal))
+    {
+        std::cerr << "Error in HSAResourceManager::RegisterDispatchTiming(): The completion signal is already 0, reset it before the dispatch.\n";
+        return false;
+    }
+
+    std::shared_ptr<PendingDispatchTiming> pPending = std::make_shared<PendingDispatchTiming>();
+    pPending->m_pLog = m_pDispatchTimingLog;
+    pPending->m_device = GPUInfo(m_gpuIndex).m_device;
+    pPending->m_completionSignal = aql.completion_signal;
+    pPending->m_hasGpuTimestamps = m_gpuIndex < ms_queues.size() && ms_queues[m_gpuIndex].m_profilingEnabled;
+    pPending->m_timing.m_kernelObject = aql.kernel_object;
+    pPending->m_timing.m_aql = aql;
+    pPending->m_timing.m_queueId = pQueue->id;
+    pPending->m_timing.m_deviceIndex = m_gpuIndex;
+
+    const AQLInfo* pAqlInfo = FindAqlInfo(aql);
+
+    if (nullptr != pAqlInfo)
+    {
+        pPending->m_timing.m_kernelSymbol = pAqlInfo->m_kernelSymbol;
+    }
+    pPending->m_timing.m_hostEnqueue = HostTimestamp();
+
+    {
+        std::lock_guard<std::mutex> lock(m_pDispatchTimingLog->m_mutex);
+        m_pDispatchTimingLog->m_pendingCount++;
+    }
+
+    // The handler is run by the runtime's signal thread once the dispatch sets the signal to 0.
+    std::shared_ptr<PendingDispatchTiming>* pHandlerRef = new std::shared_ptr<PendingDispatchTiming>(pPending);
+    hsa_status_t status = hsa_amd_signal_async_handler(aql.completion_signal,
+                                                       HSA_SIGNAL_CONDITION_EQ,
+                                                       0,
+                                                       DispatchTiming_Callback,
+                                                       pHandlerRef);
+
+    if (!HSA_CHECK_STATUS(status))
+    {
+        std::cerr << "Error in HSAResourceManager::RegisterDispatchTiming(): hsa_amd_signal_async_handler() failed.\n";
+
+        std::lock_guard<std::mutex> lock(m_pDispatchTimingLog->m_mutex);
+        m_pDispatchTimingLog->m_pendingCount--;
+        delete pHandlerRef;
+        return false;
+    }
+
+    pPendingOut = pPending;
+    return true;
+}
+
+void HSAResourceManager::SetDispatchTimingPacketId(PendingDispatchTiming& pending, uint64_t packetId)
+{
+    // Released before the packet header, so the handler sees it once the dispatch completes
+    pending.m_packetId.store(packetId, std::memory_order_release);
+}
+
+bool HSAResourceManager::WaitForDispatchTimings()
+{
+    std::unique_lock<std::mutex> lock(m_pDispatchTimingLog->m_mutex);
+
+    while (0 != m_pDispatchTimingLog->m_pendingCount)
+    {
+        m_pDispatchTimingLog->m_completed.wait(lock);
+    }
+
+    return true;
+}
+
+bool HSAResourceManager::GetDispatchTimings(std::vector<DispatchTiming>& timingsOut)
+{
+    std::lock_guard<std::mutex> lock(m_pDispatchTimingLog->m_mutex);
+    timingsOut.clear();
+    timingsOut.swap(m_pDispatchTimingLog->m_timings);
+    return true;
+}
+
 bool HSAResourceManager::CreateSignal(hsa_signal_t& signalOut)
 {
     bool ret = true;
@@ -832,10 +1160,13 @@ bool HSAResourceManager::ShutDown()
 
     if (ms_hasRuntime)
     {
-        if (!DestroyQueue())
+        for (unsigned int i = 0; i < ms_queues.size(); ++i)
         {
-            ret = false;
-            std::cerr << "Error in HSAResourceManager::ShutDown(): Destroying queue failed\n";
+            if (!DestroyDeviceQueue(i))
+            {
+                ret = false;
+                std::cerr << "Error in HSAResourceManager::ShutDown(): Destroying queue of GPU " << i << " failed\n";
+            }
         }
 
         hsa_status_t status = hsa_shut_down();
@@ -857,6 +1188,9 @@ bool HSAResourceManager::CleanUp()
     bool ret = true;
     hsa_status_t status;
 
+    // The timing handlers still registered wait on the signals destroyed below
+    WaitForDispatchTimings();
+
     // Clean up signals
     for (std::size_t i = 0; i < m_signals.size(); ++i)
     {
@@ -891,13 +1225,17 @@ bool HSAResourceManager::CleanUp()
 
     m_signals.clear();
 
-    for (std::unordered_map<const hsa_kernel_dispatch_packet_t*, AQLInfo>::iterator iter = m_aqlInfos.begin();
-         iter != m_aqlInfos.end(); ++iter)
     {
-        iter->second.m_kernArgBuffer.DestroyBuffer();
-    }
+        std::lock_guard<std::mutex> lock(m_aqlInfosMutex);
+
+        for (std::unordered_map<const hsa_kernel_dispatch_packet_t*, AQLInfo>::iterator iter = m_aqlInfos.begin();
+             iter != m_aqlInfos.end(); ++iter)
+        {
+            iter->second.m_kernArgBuffer.DestroyBuffer();
+        }
 
-    m_aqlInfos.clear();
+        m_aqlInfos.clear();
+    }
 
     // Destroy executable
     for (std::unordered_set<uint64_t>::iterator iter = m_executableSet.begin();
@@ -931,28 +1269,43 @@ bool HSAResourceManager::CleanUp()
 
     m_codeObjSet.clear();
 
-    m_aqlInfos.clear();
-
     return ret;
 }
 
 bool HSAResourceManager::DestroyQueue()
+{
+    return DestroyDeviceQueue(ms_defaultGpuIndex);
+}
+
+bool HSAResourceManager::DestroyDeviceQueue(unsigned int gpuIndex)
 {
     bool ret = true;
 
-    if (nullptr != ms_pQueue)
+    if (gpuIndex >= ms_queues.size())
+    {
+        return ret;
+    }
+
+    std::vector<hsa_queue_t*>& queues = ms_queues[gpuIndex].m_queues;
+
+    while (!queues.empty())
     {
-        hsa_status_t status = hsa_queue_destroy(ms_pQueue);
+        hsa_status_t status = hsa_queue_destroy(queues.back());
         ret = HSA_CHECK_STATUS(status);
 
         if (true != ret)
         {
-            std::cerr << "Error in HSAResourceManager::DestroyQueue(): hsa_queue_destroy() falied.\n";
-        }
-        else
-        {
-            ms_pQueue = nullptr;
+            std::cerr << "Error in HSAResourceManager::DestroyDeviceQueue(): hsa_queue_destroy() falied.\n";
+            break;
         }
+
+        queues.pop_back();
+    }
+
+    if (queues.empty())
+    {
+        ms_queues[gpuIndex].m_isMultiProducer = false;
+        ms_queues[gpuIndex].m_profilingEnabled = false;
     }
 
     return ret;
@@ -960,27 +1313,41 @@ bool HSAResourceManager::DestroyQueue()
 
 void* HSAResourceManager::AllocateCoarseLocalMemory(size_t size)
 {
-    if (0 == ms_gpu.coarseRegion.handle)
+    return AllocateCoarseLocalMemory(size, ms_defaultGpuIndex);
+}
+
+void* HSAResourceManager::AllocateCoarseLocalMemory(size_t size, unsigned int gpuIndex)
+{
+    const AgentInfo& gpu = GPUInfo(gpuIndex);
+
+    if (0 == gpu.coarseRegion.handle)
     {
         std::cerr << "AllocateCoarseLocalMemory(): No coarse memory region present, exit" << std::endl;
         return nullptr;
     }
 
     void* pBuffer = nullptr;
-    hsa_status_t status = hsa_memory_allocate(ms_gpu.coarseRegion, size, &pBuffer);
+    hsa_status_t status = hsa_memory_allocate(gpu.coarseRegion, size, &pBuffer);
     return HSA_CHECK_STATUS(status) ? pBuffer : nullptr;
 }
 
 void* HSAResourceManager::AllocateSysMemory(size_t size)
 {
-    if (0 == ms_gpu.kernargRegion.handle)
+    return AllocateSysMemory(size, ms_defaultGpuIndex);
+}
+
+void* HSAResourceManager::AllocateSysMemory(size_t size, unsigned int gpuIndex)
+{
+    const AgentInfo& gpu = GPUInfo(gpuIndex);
+
+    if (0 == gpu.kernargRegion.handle)
     {
         std::cerr << "AllocateSysMemory(): No kernel arg region present, exit." << std::endl;
         return nullptr;
     }
 
     void* pBuffer = nullptr;
-    hsa_status_t status = hsa_memory_allocate(ms_gpu.kernargRegion, size, &pBuffer);
+    hsa_status_t status = hsa_memory_allocate(gpu.kernargRegion, size, &pBuffer);
     return HSA_CHECK_STATUS(status) ? pBuffer : nullptr;
 }
 
@@ -996,6 +1363,12 @@ bool HSAResourceManager::FreeHSAMemory(void* pBuffer)
 
 bool HSAResourceManager::CopyHSAMemory(void* pDest, const void* pSrc,
                                        std::size_t size, bool hostToDev)
+{
+    return CopyHSAMemory(pDest, pSrc, size, hostToDev, ms_defaultGpuIndex);
+}
+
+bool HSAResourceManager::CopyHSAMemory(void* pDest, const void* pSrc,
+                                       std::size_t size, bool hostToDev, unsigned int gpuIndex)
 {
     if (nullptr == pDest || nullptr == pSrc)
     {
@@ -1010,7 +1383,7 @@ bool HSAResourceManager::CopyHSAMemory(void* pDest, const void* pSrc,
     }
 
     void* pBuffer = (hostToDev) ? pDest : const_cast<void*>(pSrc);
-    hsa_status_t status = hsa_memory_assign_agent(pBuffer, ms_gpu.m_device, HSA_ACCESS_PERMISSION_RW);
+    hsa_status_t status = hsa_memory_assign_agent(pBuffer, GPUInfo(gpuIndex).m_device, HSA_ACCESS_PERMISSION_RW);
 
     if (!HSA_CHECK_STATUS(status))
     {
@@ -1022,9 +1395,29 @@ bool HSAResourceManager::CopyHSAMemory(void* pDest, const void* pSrc,
 }
 
 // Accessors
+std::size_t HSAResourceManager::GPUCount()
+{
+    return ms_gpus.size();
+}
+
+unsigned int HSAResourceManager::DefaultGPUIndex()
+{
+    return ms_defaultGpuIndex;
+}
+
+unsigned int HSAResourceManager::GPUIndex() const
+{
+    return m_gpuIndex;
+}
+
 const AgentInfo& HSAResourceManager::GPUInfo()
 {
-    return ms_gpu;
+    return GPUInfo(ms_defaultGpuIndex);
+}
+
+const AgentInfo& HSAResourceManager::GPUInfo(unsigned int gpuIndex)
+{
+    return (gpuIndex < ms_gpus.size()) ? ms_gpus[gpuIndex] : gs_NO_GPU_INFO;
 }
 
 const AgentInfo& HSAResourceManager::CPUInfo()
@@ -1034,7 +1427,7 @@ const AgentInfo& HSAResourceManager::CPUInfo()
 
 const hsa_agent_t& HSAResourceManager::GPU()
 {
-    return ms_gpu.m_device;
+    return GPUInfo().m_device;
 }
 
 const hsa_agent_t& HSAResourceManager::CPU()
@@ -1044,7 +1437,7 @@ const hsa_agent_t& HSAResourceManager::CPU()
 
 const uint32_t& HSAResourceManager::GPUChipID()
 {
-    return ms_gpu.m_chipID;
+    return GPUInfo().m_chipID;
 }
 
 const uint32_t& HSAResourceManager::CPUChipID()
@@ -1054,14 +1447,48 @@ const uint32_t& HSAResourceManager::CPUChipID()
 
 hsa_queue_t* const& HSAResourceManager::Queue()
 {
-    return ms_pQueue;
+    return Queue(ms_defaultGpuIndex);
+}
+
+hsa_queue_t* const& HSAResourceManager::Queue(unsigned int gpuIndex)
+{
+    return Queue(gpuIndex, 0);
+}
+
+std::size_t HSAResourceManager::QueueCount(unsigned int gpuIndex)
+{
+    return (gpuIndex < ms_queues.size()) ? ms_queues[gpuIndex].m_queues.size() : 0;
+}
+
+hsa_queue_t* const& HSAResourceManager::Queue(unsigned int gpuIndex, unsigned int queueIndex)
+{
+    if (queueIndex < QueueCount(gpuIndex))
+    {
+        return ms_queues[gpuIndex].m_queues[queueIndex];
+    }
+
+    return gs_pNO_QUEUE;
 }
 
 AQLInfo& HSAResourceManager::GetAqlInfo(hsa_kernel_dispatch_packet_t& aql)
 {
+    return AqlInfo(aql);
+}
+
+AQLInfo& HSAResourceManager::AqlInfo(const hsa_kernel_dispatch_packet_t& aql)
+{
+    // References to the elements stay valid when other packets are added
+    std::lock_guard<std::mutex> lock(m_aqlInfosMutex);
     return m_aqlInfos[&aql];
 }
 
+const AQLInfo* HSAResourceManager::FindAqlInfo(const hsa_kernel_dispatch_packet_t& aql) const
+{
+    std::lock_guard<std::mutex> lock(m_aqlInfosMutex);
+    std::unordered_map<const hsa_kernel_dispatch_packet_t*, AQLInfo>::const_iterator iter = m_aqlInfos.find(&aql);
+    return (m_aqlInfos.end() != iter) ? &iter->second : nullptr;
+}
+
 bool InitAQL(hsa_kernel_dispatch_packet_t& aqlPacketOut)
 {
     bool ret = true;
@@ -1084,6 +1511,171 @@ bool InitAQL(hsa_kernel_dispatch_packet_t& aqlPacketOut)
     return ret;
 }
 
+bool DispatchTiming_Callback(hsa_signal_value_t value, void* pData)
+{
+    (void)value;
+    std::shared_ptr<PendingDispatchTiming>* pHandlerRef = reinterpret_cast<std::shared_ptr<PendingDispatchTiming>*>(pData);
+
+    if (nullptr == pHandlerRef)
+    {
+        std::cerr << "DispatchTiming_Callback: pData cannot be nullptr.\n";
+        return false;
+    }
+
+    // The dispatching thread may still hold the record, it is freed by whichever releases it last
+    std::shared_ptr<PendingDispatchTiming> pPending;
+    pPending.swap(*pHandlerRef);
+    delete pHandlerRef;
+
+    pPending->m_timing.m_hostComplete = HostTimestamp();
+    pPending->m_timing.m_packetId = pPending->m_packetId.load(std::memory_order_acquire);
+
+    if (pPending->m_hasGpuTimestamps)
+    {
+        hsa_amd_profiling_dispatch_time_t dispatchTimes;
+        dispatchTimes.start = 0;
+        dispatchTimes.end = 0;
+        hsa_status_t status = hsa_amd_profiling_get_dispatch_time(pPending->m_device, pPending->m_completionSignal, &dispatchTimes);
+
+        if (HSA_CHECK_STATUS(status))
+        {
+            pPending->m_timing.m_gpuStart = TimestampToNs(dispatchTimes.start);
+            pPending->m_timing.m_gpuEnd = TimestampToNs(dispatchTimes.end);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(pPending->m_pLog->m_mutex);
+        pPending->m_pLog->m_timings.push_back(pPending->m_timing);
+        pPending->m_pLog->m_pendingCount--;
+    }
+
+    pPending->m_pLog->m_completed.notify_all();
+
+    // Don't keep the handler registered, one record per dispatch.
+    return false;
+}
+
+uint64_t TimestampToNs(uint64_t ticks)
+{
+    if (0 == gs_timestampFrequency)
+    {
+        return 0;
+    }
+
+    // Split in whole seconds and the rest so that the multiplication cannot overflow
+    return ticks / gs_timestampFrequency * gs_NS_PER_SECOND + ticks % gs_timestampFrequency * gs_NS_PER_SECOND / gs_timestampFrequency;
+}
+
+uint64_t HostTimestamp()
+{
+    // Same clock as the GPU dispatch times, so host and GPU times of a dispatch can be compared
+    uint64_t ticks = 0;
+    hsa_status_t status = hsa_system_get_info(HSA_SYSTEM_INFO_TIMESTAMP, &ticks);
+    return HSA_CHECK_STATUS(status) ? TimestampToNs(ticks) : 0;
+}
+
+uint64_t ReserveQueueSlots(hsa_queue_t* pQueue, bool isMultiProducer, uint32_t count)
+{
+    // The write index of a multi producer queue is incremented atomically,
+    // a single producer queue is only written by this thread.
+    uint64_t index = 0;
+
+    if (isMultiProducer)
+    {
+        index = hsa_queue_add_write_index_relaxed(pQueue, count);
+    }
+    else
+    {
+        index = hsa_queue_load_write_index_relaxed(pQueue);
+        hsa_queue_store_write_index_relaxed(pQueue, index + count);
+    }
+
+    // Back off until the packet processor has consumed the packets previously in the slots,
+    // otherwise a full queue would have packets overwritten while they are processed
+    while (index + count - hsa_queue_load_read_index_acquire(pQueue) > pQueue->size)
+    {
+        std::this_thread::yield();
+    }
+
+    return index;
+}
+
+void WritePacketBody(hsa_queue_t* pQueue, uint64_t index, const hsa_kernel_dispatch_packet_t& aql)
+{
+    hsa_kernel_dispatch_packet_t* pSlot = reinterpret_cast<hsa_kernel_dispatch_packet_t*>(pQueue->base_address) + (index & (pQueue->size - 1));
+
+    // Everything but the header and setup, the slot keeps the invalid header left by the packet processor
+    memcpy(reinterpret_cast<char*>(pSlot) + sizeof(uint32_t),
+           reinterpret_cast<const char*>(&aql) + sizeof(uint32_t),
+           sizeof(hsa_kernel_dispatch_packet_t) - sizeof(uint32_t));
+}
+
+void PublishPacketHeader(hsa_queue_t* pQueue, uint64_t index, const hsa_kernel_dispatch_packet_t& aql)
+{
+    hsa_kernel_dispatch_packet_t* pSlot = reinterpret_cast<hsa_kernel_dispatch_packet_t*>(pQueue->base_address) + (index & (pQueue->size - 1));
+
+    // Header and setup are stored together, with release semantics so that the
+    // packet processor never sees a valid header before the rest of the packet
+    uint32_t headerAndSetup = static_cast<uint32_t>(aql.header) | (static_cast<uint32_t>(aql.setup) << 16);
+    __atomic_store_n(reinterpret_cast<uint32_t*>(pSlot), headerAndSetup, __ATOMIC_RELEASE);
+}
+
+/// Slot numbers of the live dispatching threads, a slot is given back when its thread exits
+typedef struct ThreadSlotPool
+{
+    std::mutex             m_mutex;
+    std::set<unsigned int> m_freeSlots;
+    unsigned int           m_slotCount;
+
+    ThreadSlotPool() : m_slotCount(0)
+    {}
+} ThreadSlotPool;
+
+static ThreadSlotPool& GetThreadSlotPool()
+{
+    static ThreadSlotPool s_pool;
+    return s_pool;
+}
+
+/// Holds the slot of a thread for as long as the thread lives
+class ThreadSlot
+{
+public:
+    ThreadSlot()
+    {
+        ThreadSlotPool& pool = GetThreadSlotPool();
+        std::lock_guard<std::mutex> lock(pool.m_mutex);
+
+        if (pool.m_freeSlots.empty())
+        {
+            m_slot = pool.m_slotCount++;
+        }
+        else
+        {
+            m_slot = *pool.m_freeSlots.begin();
+            pool.m_freeSlots.erase(pool.m_freeSlots.begin());
+        }
+    }
+
+    ~ThreadSlot()
+    {
+        ThreadSlotPool& pool = GetThreadSlotPool();
+        std::lock_guard<std::mutex> lock(pool.m_mutex);
+        pool.m_freeSlots.insert(m_slot);
+    }
+
+    unsigned int m_slot;
+};
+
+unsigned int ThreadQueueSlot()
+{
+    // The lowest slot free when the thread first dispatches, so that N live threads spread over N queues.
+    // The slots are process-wide because the queues of a device are shared by all the resource managers.
+    static thread_local ThreadSlot s_threadSlot;
+    return s_threadSlot.m_slot;
+}
+
 // ------------------ Definitions of HSAKernelArgBuffer ------------------------
 
 HSAKernelArgBuffer::HSAKernelArgBuffer() :
@@ -1100,6 +1692,7 @@ HSAKernelArgBuffer::~HSAKernelArgBuffer()
 }
 
 bool HSAKernelArgBuffer::AllocateBuffer(
+    unsigned int      gpuIndex,
     const std::size_t bufSize,
     const std::size_t offsetSize,
     const std::size_t clearedValue)
@@ -1107,7 +1700,7 @@ bool HSAKernelArgBuffer::AllocateBuffer(
     if (nullptr == m_pArgBuffer)
     {
         m_argBufferSize = bufSize;
-        m_pArgBuffer = HSAResourceManager::AllocateSysMemory(m_argBufferSize);
+        m_pArgBuffer = HSAResourceManager::AllocateSysMemory(m_argBufferSize, gpuIndex);
 
         if (nullptr == m_pArgBuffer)
         {
@@ -1475,6 +2068,24 @@ static const std::string GetEnv(const std::string& name)
 }
 #endif
 
+// Remove a library from a HSA_TOOLS_LIB value, where the libraries are separated by spaces
+static std::string RemoveToolsLib(const std::string& toolsLibs, const std::string& lib)
+{
+    std::istringstream libStream(toolsLibs);
+    std::string otherLib;
+    std::string remaining;
+
+    while (libStream >> otherLib)
+    {
+        if (otherLib != lib)
+        {
+            remaining += (remaining.empty() ? "" : " ") + otherLib;
+        }
+    }
+
+    return remaining;
+}
+
 bool SetSoftCPMode(bool bEnable, bool verbosePrint)
 {
     using namespace std;
@@ -1482,18 +2093,22 @@ bool SetSoftCPMode(bool bEnable, bool verbosePrint)
     const string emulateStr = "HSA_EMULATE_AQL";
     const string toolsLibStr = "HSA_TOOLS_LIB";
 
-    if (bEnable)
-    {
-        string emulateVar = "1";
-
 #ifdef _WIN64
-        string toolsLibVar = "hsa-runtime-tools64.dll";
+    const string toolsLib = "hsa-runtime-tools64.dll";
 #elif defined(_WIN32)
-        string toolsLibVar = "hsa-runtime-tools.dll";
+    const string toolsLib = "hsa-runtime-tools.dll";
 #else   // Only Linux x64 platform is supported for now. 03/18/2015
-        string toolsLibVar = "libhsa-runtime-tools64.so.1";
+    const string toolsLib = "libhsa-runtime-tools64.so.1";
 #endif
 
+    // Other tools libraries, such as the debug agent loaded by rocm-gdb, are kept
+    string otherToolsLibs = RemoveToolsLib(GetEnv(toolsLibStr), toolsLib);
+
+    if (bEnable)
+    {
+        string emulateVar = "1";
+        string toolsLibVar = otherToolsLibs.empty() ? toolsLib : toolsLib + " " + otherToolsLibs;
+
         if (0 != setenv(emulateStr.c_str(), emulateVar.c_str(), 1))
         {
             cerr << "Error in setting " << emulateStr << "\n";
@@ -1514,7 +2129,15 @@ bool SetSoftCPMode(bool bEnable, bool verbosePrint)
             ret &= false;
         }
 
-        if (0 != unsetenv(toolsLibStr.c_str()))
+        if (!otherToolsLibs.empty())
+        {
+            if (0 != setenv(toolsLibStr.c_str(), otherToolsLibs.c_str(), 1))
+            {
+                cerr << "Error in setting " << toolsLibStr << "\n";
+                ret &= false;
+            }
+        }
+        else if (0 != unsetenv(toolsLibStr.c_str()))
         {
             cerr << "Error in unsetting " << toolsLibStr << "\n";
             ret &= false;
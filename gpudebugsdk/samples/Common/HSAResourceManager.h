@@ -8,8 +8,12 @@
 #ifndef HSA_RESOURCE_MANAGER_H_
 #define HSA_RESOURCE_MANAGER_H_
 
+#include <atomic>
 #include <cstddef>
 #include <cstdint>  //  UINT64_MAX
+#include <cstring>  //  memset
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <unordered_map>
@@ -63,6 +67,30 @@ typedef struct AgentInfo
     {}
 } AgentInfo;
 
+/// \brief A struct holding the queues created on a GPU device
+typedef struct DeviceQueues
+{
+    // The queues, empty if no queue has been created on the device
+    std::vector<hsa_queue_t*> m_queues;
+
+    // Whether the queues are HSA_QUEUE_TYPE_MULTI, so that several host threads can dispatch to the same queue
+    bool m_isMultiProducer;
+
+    // Whether kernel timestamps are enabled on the queues
+    bool m_profilingEnabled;
+
+    DeviceQueues() : m_isMultiProducer(false), m_profilingEnabled(false)
+    {}
+} DeviceQueues;
+
+/// \brief How Dispatch() picks one of the queues of a device
+enum QueueSelectionPolicy
+{
+    QUEUE_SELECTION_ROUND_ROBIN,     ///< every dispatch goes to the next queue
+    QUEUE_SELECTION_THREAD_AFFINITY  ///< a host thread always dispatches to the same queue: thread n of the live dispatching
+                                     ///< threads of the process uses queue n % queue count, slots are reused when threads exit
+};
+
 // -----------------------------------------------------------------------------
 
 /// Wrap the kernel argument buffer processing
@@ -75,8 +103,15 @@ public:
     /// Destructor
     ~HSAKernelArgBuffer();
 
-    /// \brief Allocate kernel argument buffers.
-    bool AllocateBuffer(const std::size_t bufSize,
+    /// \brief Allocate kernel argument buffers in the kernarg region of a GPU.
+    ///
+    /// \param[in] gpuIndex The index of the GPU the dispatch is sent to
+    /// \param[in] bufSize Size of the buffer, in bytes
+    /// \param[in] offsetSize Offset of the first kernel argument, in bytes
+    /// \param[in] clearedValue Value the buffer is filled with
+    /// \return true if there is no error
+    bool AllocateBuffer(unsigned int      gpuIndex,
+                        const std::size_t bufSize,
                         const std::size_t offsetSize = sizeof(uint64_t) * 6,
                         const std::size_t clearedValue = 0x0);
 
@@ -127,26 +162,74 @@ typedef struct AQLInfo
     hsa_signal_t m_completionSignal;
     hsa_executable_t m_executable;
     hsa_code_object_t m_codeObj;
+    std::string m_kernelSymbol;
     HSAKernelArgBuffer m_kernArgBuffer;
 
     AQLInfo() : m_completionSignal({0}), m_executable({0}), m_codeObj({0}), m_kernArgBuffer(){}
     AQLInfo(const AQLInfo& aqlInfo) :
         m_completionSignal({0}),
         m_executable(aqlInfo.m_executable),
-        m_codeObj(aqlInfo.m_codeObj)
+        m_codeObj(aqlInfo.m_codeObj),
+        m_kernelSymbol(aqlInfo.m_kernelSymbol)
     {}
 } AQLInfo;
 
+/// \brief A struct holding the timing information of a single kernel dispatch
+typedef struct DispatchTiming
+{
+    // Kernel object of the dispatched kernel
+    uint64_t m_kernelObject;
+
+    // Kernel entry point, empty if the aql packet was not created by the resource manager
+    std::string m_kernelSymbol;
+
+    // The dispatched AQL packet
+    hsa_kernel_dispatch_packet_t m_aql;
+
+    // Id of the queue the packet was dispatched to, and index of its GPU in the resource manager
+    uint64_t m_queueId;
+    unsigned int m_deviceIndex;
+
+    // Index of the dispatch packet in the queue
+    uint64_t m_packetId;
+
+    // GPU start and end timestamps in nanoseconds of the HSA system timestamp, 0 if kernel timestamps are not enabled on the queue
+    uint64_t m_gpuStart;
+    uint64_t m_gpuEnd;
+
+    // Host-side enqueue and completion times in nanoseconds of the HSA system timestamp
+    uint64_t m_hostEnqueue;
+    uint64_t m_hostComplete;
+
+    DispatchTiming() : m_kernelObject(0), m_queueId(0), m_deviceIndex(0), m_packetId(0), m_gpuStart(0), m_gpuEnd(0),
+                       m_hostEnqueue(0), m_hostComplete(0)
+    {
+        memset(&m_aql, 0, sizeof(m_aql));
+    }
+} DispatchTiming;
+
+// Timing records shared with the asynchronous completion signal handlers.
+struct DispatchTimingLog;
+
+// Timing record of a dispatch in flight, shared by the dispatching thread and its completion signal handler.
+struct PendingDispatchTiming;
+
 class HSAResourceManager
 {
 public:
-    /// \brief Default constructor, initialize member variable
+    /// \brief Default constructor, initialize member variable.
+    ///        Kernels are finalized for and dispatched to the default GPU selected by InitRuntime().
     HSAResourceManager();
 
+    /// \brief Constructor, kernels are finalized for and dispatched to the specified GPU.
+    ///
+    /// \param[in] gpuIndex The index of the GPU, between 0 and GPUCount() - 1
+    explicit HSAResourceManager(unsigned int gpuIndex);
+
     /// \brief Destructor, will call Destroy() to release resources.
     ~HSAResourceManager();
 
-    /// \brief Call hsa_init() and setup a default GPU device
+    /// \brief Call hsa_init(), query all the GPU devices and setup a default GPU device
     /// \param[in] verbosePrint  set to true to print extra message outputs to console
     /// \param[in] gpuIndex  The index of the GPU to use by default in a multi-GPU system
     ///
@@ -176,6 +259,29 @@ public:
     /// \return true if there is no error
     static bool CreateDefaultQueue(bool enableKernelTimestamps = false);
 
+    /// \brief Create the queue of a GPU device, used by the resource managers of that device.
+    ///
+    /// \param[in] gpuIndex The index of the GPU
+    /// \param[in] enableKernelTimestamps flag indicating whether or not profiling is enabled on this queue
+    /// \return true if there is no error
+    static bool CreateDeviceQueue(unsigned int gpuIndex, bool enableKernelTimestamps = false);
+
+    /// \brief Create a pool of queues on a GPU device, replacing the existing ones.
+    ///        Dispatch() picks one of them according to the queue selection policy.
+    ///
+    /// \param[in] gpuIndex The index of the GPU
+    /// \param[in] queueCount Number of queues to create
+    /// \param[in] multiProducer true to create HSA_QUEUE_TYPE_MULTI queues, which any number of host threads
+    ///            can dispatch to. A HSA_QUEUE_TYPE_SINGLE queue must only be dispatched to by one thread.
+    /// \param[in] enableKernelTimestamps flag indicating whether or not profiling is enabled on the queues
+    /// \return true if there is no error
+    static bool CreateDeviceQueues(unsigned int gpuIndex, unsigned int queueCount, bool multiProducer, bool enableKernelTimestamps = false);
+
+    /// \brief Set how Dispatch() picks one of the queues of the device, QUEUE_SELECTION_ROUND_ROBIN by default.
+    ///
+    /// \param[in] policy The queue selection policy
+    void SetQueueSelectionPolicy(QueueSelectionPolicy policy);
+
     /// \brief overide the default queue with the specified queue (deleting the default queue if necessary)
     ///
     /// \param[in] pQueue the queue to replace the default queue with
@@ -220,6 +326,18 @@ public:
         hsa_kernel_dispatch_packet_t& aqlPacketOut,
         const std::size_t&            kernargOffset = sizeof(uint64_t) * 6);
 
+    /// \brief Load a serialized code object, as produced by hsa_code_object_serialize(), into a new executable
+    ///        for the GPU device. The code object and executable are released by CleanUp().
+    ///
+    /// \param[in]  pSerializedCodeObj  The serialized code object
+    /// \param[in]  size                Size of the serialized code object in bytes
+    /// \param[out] executableOut       The frozen executable, ready for CreateAQLFromExecutable()
+    /// \return true if there is no error
+    bool CreateExecutableFromCodeObject(
+        const void*             pSerializedCodeObj,
+        const std::size_t       size,
+              hsa_executable_t& executableOut);
+
     /// \brief Copy one aql packet setting to another
     ///
     /// \param[in]  aqlPacket     The AQL packet to be copied from
@@ -268,11 +386,24 @@ public:
     bool DeregisterKernelArgsBuffer(hsa_kernel_dispatch_packet_t& aql);
 
     /// \brief Dispatch AQL kernel dispatch packet
+    ///        Several host threads can dispatch at the same time, once their aql packets are created,
+    ///        if the queues of the device are multi producer, or if every thread has its own queue
+    ///        through QUEUE_SELECTION_THREAD_AFFINITY, which holds while no more threads than queues dispatch at once.
+    ///        Blocks while the selected queue is full.
     ///
     /// \param[in] aqlPacket The AQL packet going to be dispatch.
     /// \return true if there is no error
     bool Dispatch(hsa_kernel_dispatch_packet_t& aqlPacket);
 
+    /// \brief Dispatch several AQL kernel dispatch packets to the same queue, with a single doorbell ring.
+    ///        The slots are reserved together and the headers published in order, so the packets
+    ///        are processed in array order. Batches larger than the queue are split.
+    ///
+    /// \param[in] pAqlPackets The AQL packets going to be dispatch.
+    /// \param[in] count Number of packets in pAqlPackets
+    /// \return true if there is no error
+    bool DispatchBatch(hsa_kernel_dispatch_packet_t* pAqlPackets, std::size_t count);
+
     /// \brief Wait for the AQL packet completion signal value be set to 0 as completion.
     ///        Once the AQL dispatch complete, the signal value will be set back to 1 by
     ///        this function.
@@ -285,6 +416,26 @@ public:
     /// \return true if there is no error
     bool WaitForCompletion(hsa_signal_t& completionSignal, uint64_t timeout = UINT64_MAX, bool outputTimingData = false);
 
+    /// \brief Enable or disable the collection of dispatch timing records.
+    ///        When enabled, Dispatch() registers an asynchronous handler on the completion signal
+    ///        of every dispatch, the record is filled in by the handler when the dispatch completes
+    ///        so no dispatch is ever waited on. The completion signal of a dispatch must not be 0 when
+    ///        it is dispatched, nor be reset before its record has been collected (see WaitForDispatchTimings()).
+    ///
+    /// \param[in] enable true to collect timing records for the following dispatches
+    void EnableDispatchTiming(bool enable);
+
+    /// \brief Wait until the timing records of all the dispatches issued so far have been collected.
+    ///
+    /// \return true if there is no error
+    bool WaitForDispatchTimings();
+
+    /// \brief Move the collected dispatch timing records out, in completion order.
+    ///
+    /// \param[out] timingsOut The collected records, the internal record list is cleared.
+    /// \return true if there is no error
+    bool GetDispatchTimings(std::vector<DispatchTiming>& timingsOut);
+
     /// \brief Create a signal with default value 1.
     ///
     /// \param[out] signalOut The signal handle to be put into the created signal variable.
@@ -308,18 +459,38 @@ public:
     /// \return true if there is no error
     static bool DestroyQueue();
 
+    /// \brief Destroy the queues created by CreateDeviceQueue() or CreateDeviceQueues().
+    ///
+    /// \param[in] gpuIndex The index of the GPU
+    /// \return true if there is no error
+    static bool DestroyDeviceQueue(unsigned int gpuIndex);
+
     /// \brief Allocate HSA device local memory in coarse grain region, if there is.
     ///
     /// \param[in] size Size of memory to be allocated, in bytes
     /// \return Pointer to the allocated memory location, nullptr if fail.
     static void* AllocateCoarseLocalMemory(size_t size);
 
+    /// \brief Allocate HSA device local memory in coarse grain region of the specified GPU, if there is.
+    ///
+    /// \param[in] size Size of memory to be allocated, in bytes
+    /// \param[in] gpuIndex The index of the GPU
+    /// \return Pointer to the allocated memory location, nullptr if fail.
+    static void* AllocateCoarseLocalMemory(size_t size, unsigned int gpuIndex);
+
     /// \brief Allocate HSA kerenarg memory region
     ///
     /// \param[in] size Size of memory to be allocated, in bytes
     /// \return Pointer to the allocated memory location, nullptr if fail.
     static void* AllocateSysMemory(size_t size);
 
+    /// \brief Allocate HSA kerenarg memory region of the specified GPU
+    ///
+    /// \param[in] size Size of memory to be allocated, in bytes
+    /// \param[in] gpuIndex The index of the GPU
+    /// \return Pointer to the allocated memory location, nullptr if fail.
+    static void* AllocateSysMemory(size_t size, unsigned int gpuIndex);
+
     /// \brief Free HSA memory
     ///
     /// \param[in] Pointer to the memory location to be freed.
@@ -335,6 +506,16 @@ public:
     /// \return true if there is no error.
     static bool CopyHSAMemory(void* pDest, const void* pSrc, std::size_t size, bool hostToDev);
 
+    /// \brief Copy HSA memory from or to the specified GPU
+    ///
+    /// \param[in] pDest Pointer to destination memory location.
+    /// \param[in] pSrc Pointer to source memory location.
+    /// \param[in] size Size of memory to be copy, in bytes.
+    /// \param[in] hostToDev Marker to tell whether it is going to be copied from host (CPU) to device (GPU).
+    /// \param[in] gpuIndex The index of the GPU
+    /// \return true if there is no error.
+    static bool CopyHSAMemory(void* pDest, const void* pSrc, std::size_t size, bool hostToDev, unsigned int gpuIndex);
+
 
     /// \brief return whether it has an HSA runtime initialized in it.
     ///
@@ -342,11 +523,32 @@ public:
     static bool HasRuntime();
 
     // Accessors
+    /// \brief return the number of GPU devices
+    ///
+    /// \return number of GPU devices found by InitRuntime()
+    static std::size_t GPUCount();
+
+    /// \brief return the index of the default GPU
+    ///
+    /// \return index of the default GPU
+    static unsigned int DefaultGPUIndex();
+
+    /// \brief return the index of the GPU used by this resource manager
+    ///
+    /// \return index of the GPU
+    unsigned int GPUIndex() const;
+
     /// \brief return GPU agent info
     ///
     /// \return GPU agent info
     static const AgentInfo& GPUInfo();
 
+    /// \brief return GPU agent info of the specified GPU
+    ///
+    /// \param[in] gpuIndex The index of the GPU
+    /// \return GPU agent info, with a null device handle if gpuIndex is not valid
+    static const AgentInfo& GPUInfo(unsigned int gpuIndex);
+
     /// \brief return CPU agent info
     ///
     /// \return CPU agent info
@@ -378,7 +580,28 @@ public:
     /// \return the default queue
     static hsa_queue_t* const& Queue();
 
+    /// \brief return the queue of the specified GPU
+    ///
+    /// \param[in] gpuIndex The index of the GPU
+    /// \return the queue, nullptr if there is none
+    static hsa_queue_t* const& Queue(unsigned int gpuIndex);
+
+    /// \brief return the number of queues of the specified GPU
+    ///
+    /// \param[in] gpuIndex The index of the GPU
+    /// \return the number of queues
+    static std::size_t QueueCount(unsigned int gpuIndex);
+
+    /// \brief return one of the queues of the specified GPU
+    ///
+    /// \param[in] gpuIndex The index of the GPU
+    /// \param[in] queueIndex The index of the queue
+    /// \return the queue, nullptr if there is none
+    static hsa_queue_t* const& Queue(unsigned int gpuIndex, unsigned int queueIndex);
+
     /// \brief Get specific AQLInfo
+    ///        Adding packet information is safe while other threads dispatch, but the returned
+    ///        AQLInfo must not be changed while its own packet is being dispatched.
     ///
     /// \param[in] aql The aql which to be getting its AQLInfo
     /// \param[in] return the AQLInfo
@@ -399,25 +622,56 @@ private:
               hsa_executable_t&     executableOut,
               hsa_code_object_t&    codeObjOut);
 
+    /// \brief Create an executable from codeObj for the GPU device, load the code object and freeze it
+    bool LoadExecutable(
+        const hsa_profile_t         hsaProfile,
+        const hsa_code_object_t&    codeObj,
+              hsa_executable_t&     executableOut);
+
+    /// \brief Get the AQLInfo of aql under m_aqlInfosMutex, adding it if there is none.
+    AQLInfo& AqlInfo(const hsa_kernel_dispatch_packet_t& aql);
+
+    /// \brief Look the AQLInfo of aql up under m_aqlInfosMutex, nullptr if there is none.
+    const AQLInfo* FindAqlInfo(const hsa_kernel_dispatch_packet_t& aql) const;
+
+    /// \brief Pick the queue of the next dispatch according to m_queueSelectionPolicy.
+    hsa_queue_t* SelectQueue(bool& isMultiProducerOut);
+
+    /// \brief Register an asynchronous handler to fill in the timing record of a dispatch.
+    ///        The packet id of pPendingOut must be set with SetDispatchTimingPacketId() once the queue slot is reserved.
+    bool RegisterDispatchTiming(const hsa_kernel_dispatch_packet_t& aql, const hsa_queue_t* pQueue, std::shared_ptr<PendingDispatchTiming>& pPendingOut);
+
+    /// \brief Set the packet id of a dispatch registered by RegisterDispatchTiming(), before its header is published.
+    static void SetDispatchTimingPacketId(PendingDispatchTiming& pending, uint64_t packetId);
+
     // Member variables
     static AMDT::HSAFinalizer ms_finalizer;
 
     static uint16_t ms_hsaCount;
     static bool ms_hasRuntime;
-    static bool ms_profilingEnabled;
 
-    /// \todo: Inorder to support multi-GPU system we should use vector<>
-    //        (or something similar) here.
-    static AgentInfo   ms_gpu;
-    static AgentInfo   ms_cpu;
+    static std::vector<AgentInfo> ms_gpus;
+    static AgentInfo              ms_cpu;
+    static unsigned int           ms_defaultGpuIndex;
 
-    static hsa_queue_t* ms_pQueue;
+    /// Queues of every GPU, in the same order as ms_gpus
+    static std::vector<DeviceQueues> ms_queues;
+
+    unsigned int m_gpuIndex;
+    QueueSelectionPolicy m_queueSelectionPolicy;
+    std::atomic<unsigned int> m_nextQueueIndex;
 
     std::vector<hsa_signal_t> m_signals;
     std::unordered_map<const hsa_kernel_dispatch_packet_t*, AQLInfo> m_aqlInfos;
+    /// Guards m_aqlInfos, packets can be registered by one thread while others dispatch.
+    mutable std::mutex m_aqlInfosMutex;
     std::unordered_set<uint64_t> m_executableSet;
     std::unordered_set<uint64_t> m_codeObjSet;
 
+    bool m_dispatchTimingEnabled;
+    /// Held through a shared_ptr so it outlives the handlers of dispatches still in flight.
+    std::shared_ptr<DispatchTimingLog> m_pDispatchTimingLog;
+
 }; // class HSAResourceManager
 
 // -----------------------------------------------------------------------------
@@ -443,6 +697,8 @@ bool HsaCheckStatus(hsa_status_t s, const std::string& fileName, int lineNum);
 std::string HsaStatusStrings(hsa_status_t s);
 
 /// \brief Enable or disable soft CP mode (set HSA_EMULATE_AQL and HSA_TOOLS_LIB environment variables)
+///        Only the runtime tools library is added to or removed from HSA_TOOLS_LIB, other
+///        tools libraries already listed, such as the debug agent, are kept.
 ///
 /// \param[in] bEnable       true to enable soft CP mode, false to disable soft CP mode
 /// \param[in] verbosePrint  set to true to print the extra message outputs to console
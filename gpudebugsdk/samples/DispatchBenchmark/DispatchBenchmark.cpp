@@ -0,0 +1,383 @@
+//==============================================================================
+// Copyright (c) 2017 Advanced Micro Devices, Inc. All rights reserved.
+//
+/// \author AMD Developer Tools
+/// \file
+/// \brief  Measure the kernel dispatch throughput of HSAResourceManager when
+///         1 to N host threads dispatch at the same time, to a pool of
+///         single or multi producer queues, or when the packets are
+///         dispatched in batches.  The kernel is a one work-group matrix
+///         multiplication, so that the dispatch path dominates.
+//==============================================================================
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <hsa.h>
+
+#include "HSAResourceManager.h"
+
+static const std::string gs_MATRIX_MUL_KERNEL_SYMBOL = "&__OpenCL_matrixMul_kernel";
+static const std::string gs_MATRIX_MUL_KERNEL_BRIG_FILE = "../MatrixMultiplication/matrixMul_kernel.brig";
+
+/// Number of dispatches in flight per thread before it waits for them
+static const unsigned int gs_DISPATCH_WINDOW = 64;
+
+/// Largest batch of the batch benchmark, dispatches are waited for every gs_MAX_BATCH_SIZE packets
+static const unsigned int gs_MAX_BATCH_SIZE = 256;
+
+/// Width and height of the matrices, a single work-group
+static const uint32_t gs_MATRIX_SIZE = 16;
+
+// ================================= Functions declaration ============================================
+
+bool RunBenchmark(const std::string& brigFile, unsigned int threadCount, unsigned int queueCount,
+                  bool multiProducer, AMDT::QueueSelectionPolicy policy, unsigned int dispatchCount, bool batchMode);
+
+// Helper function to dispatch the aql packet in batches of 1 to gs_MAX_BATCH_SIZE and report the packet rate.
+bool RunBatchBenchmark(AMDT::HSAResourceManager& myHsa, const hsa_kernel_dispatch_packet_t& aql, unsigned int dispatchCount);
+
+// Thread function, dispatch the aql packet dispatchCount times in windows of gs_DISPATCH_WINDOW.
+void DispatchThread(AMDT::HSAResourceManager* pMyHsa, hsa_kernel_dispatch_packet_t* pAql,
+                    unsigned int dispatchCount, bool* pRetOut);
+
+// Helper function to load binary file into data.
+bool LoadFile(const std::string& fileName, std::vector<char>& data);
+
+// =====================================================================================================
+
+int main(int argc, char** argv)
+{
+    std::string brigFile = gs_MATRIX_MUL_KERNEL_BRIG_FILE;
+    unsigned int threadCount = 4;
+    unsigned int queueCount = 1;
+    unsigned int dispatchCount = 10000;
+    bool multiProducer = false;
+    bool batchMode = false;
+    AMDT::QueueSelectionPolicy policy = AMDT::QUEUE_SELECTION_ROUND_ROBIN;
+    bool showUsage = false;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string ipOption(argv[i]);
+
+        if (ipOption == "--threads" && i + 1 < argc)
+        {
+            threadCount = static_cast<unsigned int>(strtoul(argv[++i], nullptr, 10));
+        }
+        else if (ipOption == "--queues" && i + 1 < argc)
+        {
+            queueCount = static_cast<unsigned int>(strtoul(argv[++i], nullptr, 10));
+        }
+        else if (ipOption == "--count" && i + 1 < argc)
+        {
+            dispatchCount = static_cast<unsigned int>(strtoul(argv[++i], nullptr, 10));
+        }
+        else if (ipOption == "--multi")
+        {
+            multiProducer = true;
+        }
+        else if (ipOption == "--batch")
+        {
+            batchMode = true;
+        }
+        else if (ipOption == "--policy" && i + 1 < argc)
+        {
+            std::string policyName(argv[++i]);
+
+            if (policyName == "roundrobin")
+            {
+                policy = AMDT::QUEUE_SELECTION_ROUND_ROBIN;
+            }
+            else if (policyName == "affinity")
+            {
+                policy = AMDT::QUEUE_SELECTION_THREAD_AFFINITY;
+            }
+            else
+            {
+                showUsage = true;
+            }
+        }
+        else if (ipOption == "--brig" && i + 1 < argc)
+        {
+            brigFile = argv[++i];
+        }
+        else if (ipOption == "--softcp" || ipOption == "--hwqueue")
+        {
+            // Needs to be done before the HSA runtime is initialized
+            AMDT::SetSoftCPMode(ipOption == "--softcp");
+        }
+        else
+        {
+            showUsage = true;
+        }
+    }
+
+    if (showUsage || 0 == threadCount || 0 == queueCount || 0 == dispatchCount)
+    {
+        std::cout << "DispatchBenchmark reports the dispatch throughput of 1 to N host threads\n";
+        std::cout << "Usage: DispatchBenchmark [options]\n";
+        std::cout << "Possible options\n";
+        std::cout << " \t--threads <N>\t\t dispatch from 1 to N host threads (default 4)\n";
+        std::cout << " \t--queues <N>\t\t create N queues on the GPU (default 1)\n";
+        std::cout << " \t--multi\t\t\t create multi producer queues, shared by all the threads\n";
+        std::cout << " \t--policy <name>\t\t roundrobin or affinity, how a dispatch picks its queue (default roundrobin)\n";
+        std::cout << " \t--count <N>\t\t dispatches per thread (default 10000)\n";
+        std::cout << " \t--batch\t\t\t dispatch from one thread in batches of 1 to " << gs_MAX_BATCH_SIZE << " packets instead\n";
+        std::cout << " \t--brig <file>\t\t the matrixMul_kernel.brig of the MatrixMultiplication sample\n";
+        std::cout << " \t--softcp\t\t run all queues through software AQL emulation (SoftCP mode)\n";
+        std::cout << " \t--hwqueue\t\t run all queues on the hardware queues (SoftCP mode disabled)\n";
+        return 1;
+    }
+
+    // A single producer queue must only be written by one thread
+    if (!batchMode && !multiProducer && 1 < threadCount &&
+        (AMDT::QUEUE_SELECTION_THREAD_AFFINITY != policy || queueCount < threadCount))
+    {
+        std::cerr << "Error: " << threadCount << " threads need --multi, or --policy affinity with at least "
+                  << threadCount << " queues.\n";
+        return 1;
+    }
+
+    return RunBenchmark(brigFile, threadCount, queueCount, multiProducer, policy, dispatchCount, batchMode) ? 0 : 1;
+}
+
+bool RunBenchmark(const std::string& brigFile, unsigned int threadCount, unsigned int queueCount,
+                  bool multiProducer, AMDT::QueueSelectionPolicy policy, unsigned int dispatchCount, bool batchMode)
+{
+    using namespace AMDT;
+
+    // Initialize HSA runtime
+    std::cout << "Initializing HSA runtime...\n";
+
+    if (true != HSAResourceManager::InitRuntime(false))
+    {
+        std::cerr << "RunBenchmark(): HSA runtime initialization fail, exiting...\n";
+        return false;
+    }
+
+    HSAResourceManager myHsa;
+
+    if (!HSAResourceManager::CreateDeviceQueues(HSAResourceManager::DefaultGPUIndex(), queueCount, multiProducer))
+    {
+        std::cerr << "RunBenchmark(): Error on creating the queues.\n";
+        HSAResourceManager::ShutDown();
+        return false;
+    }
+
+    myHsa.SetQueueSelectionPolicy(policy);
+
+    std::vector<char> brigData;
+
+    if (!LoadFile(brigFile, brigData) || brigData.empty())
+    {
+        std::cerr << "Error in RunBenchmark(): Cannot load \"" << brigFile << "\".\n";
+        HSAResourceManager::ShutDown();
+        return false;
+    }
+
+    const std::size_t bufferSize = gs_MATRIX_SIZE * gs_MATRIX_SIZE * sizeof(float);
+    float* pBufferA = (float*) HSAResourceManager::AllocateSysMemory(bufferSize);
+    float* pBufferB = (float*) HSAResourceManager::AllocateSysMemory(bufferSize);
+    float* pBufferC = (float*) HSAResourceManager::AllocateSysMemory(bufferSize);
+
+    // The kernel is finalized once, every thread has its own packet and completion signal
+    hsa_kernel_dispatch_packet_t finalizedAql;
+    std::vector<hsa_kernel_dispatch_packet_t> aql(threadCount);
+    bool ret = nullptr != pBufferA && nullptr != pBufferB && nullptr != pBufferC &&
+               myHsa.CreateAQLPacketFromBrig(&brigData[0], gs_MATRIX_MUL_KERNEL_SYMBOL, false, finalizedAql);
+
+    if (!ret)
+    {
+        std::cerr << "RunBenchmark(): Error in finalizing the kernel.\n";
+    }
+
+    for (unsigned int t = 0; ret && t < threadCount; ++t)
+    {
+        const hsa_executable_t& executable = myHsa.GetAqlInfo(finalizedAql).m_executable;
+
+        ret = myHsa.CreateAQLFromExecutable(executable, gs_MATRIX_MUL_KERNEL_SYMBOL, true, aql[t]);
+
+        aql[t].setup |= 2 << HSA_KERNEL_DISPATCH_PACKET_SETUP_DIMENSIONS;
+        aql[t].workgroup_size_x = gs_MATRIX_SIZE;
+        aql[t].workgroup_size_y = gs_MATRIX_SIZE;
+        aql[t].grid_size_x = gs_MATRIX_SIZE;
+        aql[t].grid_size_y = gs_MATRIX_SIZE;
+
+        // The kernel arguments are registered here, Dispatch() then only reads the packet information
+        ret = ret &&
+              myHsa.AppendKernelArgs(&pBufferC, sizeof(float*), aql[t]) &&
+              myHsa.AppendKernelArgs(&pBufferA, sizeof(float*), aql[t]) &&
+              myHsa.AppendKernelArgs(&pBufferB, sizeof(float*), aql[t]) &&
+              myHsa.AppendKernelArgs(&gs_MATRIX_SIZE, sizeof(uint32_t), aql[t]) &&
+              myHsa.AppendKernelArgs(&gs_MATRIX_SIZE, sizeof(uint32_t), aql[t]) &&
+              myHsa.RegisterKernelArgsBuffer(aql[t]);
+
+        if (!ret)
+        {
+            std::cerr << "RunBenchmark(): Error in creating the AQL packet of thread " << t << ".\n";
+        }
+    }
+
+    if (ret && batchMode)
+    {
+        ret = RunBatchBenchmark(myHsa, aql[0], dispatchCount);
+    }
+    else if (ret)
+    {
+        std::cout << queueCount << (multiProducer ? " multi" : " single") << " producer queue(s), "
+                  << (QUEUE_SELECTION_THREAD_AFFINITY == policy ? "thread affinity" : "round robin") << " policy, "
+                  << dispatchCount << " dispatches per thread\n";
+    }
+
+    double singleThreadRate = 0.0;
+
+    for (unsigned int usedThreadCount = 1; !batchMode && ret && usedThreadCount <= threadCount; ++usedThreadCount)
+    {
+        std::vector<std::thread> threads;
+        std::unique_ptr<bool[]> threadRet(new bool[usedThreadCount]());
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        for (unsigned int t = 0; t < usedThreadCount; ++t)
+        {
+            threads.push_back(std::thread(DispatchThread, &myHsa, &aql[t], dispatchCount, &threadRet[t]));
+        }
+
+        for (std::size_t t = 0; t < threads.size(); ++t)
+        {
+            threads[t].join();
+        }
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        for (unsigned int t = 0; t < usedThreadCount; ++t)
+        {
+            ret = ret && threadRet[t];
+        }
+
+        if (!ret)
+        {
+            std::cerr << "Error in RunBenchmark(): Dispatch from " << usedThreadCount << " threads failed.\n";
+            break;
+        }
+
+        const double rate = usedThreadCount * dispatchCount / elapsed.count();
+
+        if (1 == usedThreadCount)
+        {
+            singleThreadRate = rate;
+        }
+
+        std::cout << usedThreadCount << " thread(s): " << rate << " dispatches per second, scaling "
+                  << rate / singleThreadRate << "x\n";
+    }
+
+    HSAResourceManager::FreeHSAMemory(pBufferA);
+    HSAResourceManager::FreeHSAMemory(pBufferB);
+    HSAResourceManager::FreeHSAMemory(pBufferC);
+
+    myHsa.CleanUp();
+    HSAResourceManager::ShutDown();
+
+    return ret;
+}
+
+bool RunBatchBenchmark(AMDT::HSAResourceManager& myHsa, const hsa_kernel_dispatch_packet_t& aql, unsigned int dispatchCount)
+{
+    // Copies of the same packet, they share the kernel arguments and the completion signal
+    std::vector<hsa_kernel_dispatch_packet_t> batch(gs_MAX_BATCH_SIZE, aql);
+    hsa_signal_t completionSignal = aql.completion_signal;
+
+    // Whole windows of gs_MAX_BATCH_SIZE packets, so that every batch size dispatches the same packets
+    const unsigned int windowCount = (dispatchCount + gs_MAX_BATCH_SIZE - 1) / gs_MAX_BATCH_SIZE;
+
+    std::cout << "Dispatching " << windowCount * gs_MAX_BATCH_SIZE << " packets per batch size\n";
+
+    for (unsigned int batchSize = 1; batchSize <= gs_MAX_BATCH_SIZE; batchSize *= 2)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        for (unsigned int window = 0; window < windowCount; ++window)
+        {
+            // Every completed kernel decrements the signal, it reaches 0 once the whole window is done
+            hsa_signal_store_relaxed(completionSignal, gs_MAX_BATCH_SIZE);
+
+            for (unsigned int i = 0; i < gs_MAX_BATCH_SIZE; i += batchSize)
+            {
+                if (!myHsa.DispatchBatch(&batch[i], batchSize))
+                {
+                    std::cerr << "RunBatchBenchmark(): Error on DispatchBatch()\n";
+                    return false;
+                }
+            }
+
+            if (!myHsa.WaitForCompletion(completionSignal))
+            {
+                std::cerr << "Error in RunBatchBenchmark(): Signal return error.\n";
+                return false;
+            }
+        }
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        std::cout << "Batch of " << batchSize << ": " << windowCount * gs_MAX_BATCH_SIZE / elapsed.count()
+                  << " packets per second\n";
+    }
+
+    return true;
+}
+
+void DispatchThread(AMDT::HSAResourceManager* pMyHsa, hsa_kernel_dispatch_packet_t* pAql,
+                    unsigned int dispatchCount, bool* pRetOut)
+{
+    bool ret = true;
+
+    for (unsigned int i = 0; ret && i < dispatchCount; i += gs_DISPATCH_WINDOW)
+    {
+        const unsigned int windowSize = (dispatchCount - i < gs_DISPATCH_WINDOW) ? dispatchCount - i : gs_DISPATCH_WINDOW;
+
+        // Every completed kernel decrements the signal, it reaches 0 once the whole window is done
+        hsa_signal_store_relaxed(pAql->completion_signal, windowSize);
+
+        for (unsigned int j = 0; ret && j < windowSize; ++j)
+        {
+            ret = pMyHsa->Dispatch(*pAql);
+        }
+
+        ret = ret && pMyHsa->WaitForCompletion(pAql->completion_signal);
+    }
+
+    *pRetOut = ret;
+}
+
+bool LoadFile(const std::string& fileName, std::vector<char>& data)
+{
+    bool ret = false;
+    std::ifstream inFile(fileName, std::ios::binary);
+
+    if (inFile.good())
+    {
+        // get the size of the file;
+        inFile.seekg(0, std::ios::end);
+        std::size_t length = inFile.tellg();
+        inFile.seekg(0, std::ios::beg);
+
+        data.clear();
+        data.resize(length, 0);
+        inFile.read(&data[0], length);
+        ret = true;
+    }
+    else
+    {
+        std::cerr << "Error in LoadFile(): Error when open file \"" << fileName << "\"\n";
+        ret = false;
+    }
+
+    inFile.close();
+    return ret;
+}
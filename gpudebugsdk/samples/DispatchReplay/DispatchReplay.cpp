@@ -0,0 +1,317 @@
+//==============================================================================
+// Copyright (c) 2017 Advanced Micro Devices, Inc. All rights reserved.
+//
+/// \author AMD Developer Tools
+/// \file
+/// \brief  Replay the kernel dispatches of a capture file written by
+///         HSADispatchCapture, standalone from the captured application.
+///         Every dispatch is replayed on copies of its captured buffers
+///         and its kernel execution time is reported, so that a captured
+///         dispatch can be used as a regression benchmark.
+//==============================================================================
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+
+#include <hsa.h>
+
+#include "HSAResourceManager.h"
+#include "HSADispatchCapture.h"
+
+// ================================= Functions declaration ============================================
+
+bool RunReplay(const std::string& captureFile, unsigned int iterationCount);
+
+// Helper function to replay one captured dispatch iterationCount times.
+bool ReplayDispatch(AMDT::HSAResourceManager& myHsa, const AMDT::CapturedDispatch& dispatch,
+                    const hsa_executable_t& executable, unsigned int iterationCount);
+
+// =====================================================================================================
+
+int main(int argc, char** argv)
+{
+    std::string captureFile;
+    unsigned int iterationCount = 1;
+    bool showUsage = false;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string ipOption(argv[i]);
+
+        if (ipOption == "--iterations" && i + 1 < argc)
+        {
+            iterationCount = static_cast<unsigned int>(strtoul(argv[++i], nullptr, 10));
+        }
+        else if (ipOption == "--softcp" || ipOption == "--hwqueue")
+        {
+            // Needs to be done before the HSA runtime is initialized
+            AMDT::SetSoftCPMode(ipOption == "--softcp");
+        }
+        else if ('-' != ipOption[0] && captureFile.empty())
+        {
+            captureFile = ipOption;
+        }
+        else
+        {
+            showUsage = true;
+        }
+    }
+
+    if (showUsage || captureFile.empty() || 0 == iterationCount)
+    {
+        std::cout << "DispatchReplay replays the kernel dispatches of a capture file\n";
+        std::cout << "Usage: DispatchReplay <capture file> [options]\n";
+        std::cout << "Possible options\n";
+        std::cout << " \t--iterations <N>\t replay every dispatch N times and report its kernel execution time\n";
+        std::cout << " \t--softcp\t\t run all queues through software AQL emulation (SoftCP mode)\n";
+        std::cout << " \t--hwqueue\t\t run all queues on the hardware queues (SoftCP mode disabled)\n";
+        return 1;
+    }
+
+    return RunReplay(captureFile, iterationCount) ? 0 : 1;
+}
+
+bool RunReplay(const std::string& captureFile, unsigned int iterationCount)
+{
+    using namespace AMDT;
+
+    DispatchCaptureReader reader;
+
+    if (!reader.Open(captureFile))
+    {
+        std::cerr << "Error in RunReplay(): Cannot read capture file \"" << captureFile << "\"\n";
+        return false;
+    }
+
+    // Initialize HSA runtime
+    std::cout << "Initializing HSA runtime...\n";
+
+    if (true != HSAResourceManager::InitRuntime(false))
+    {
+        std::cerr << "RunReplay(): HSA runtime initialization fail, exiting...\n";
+        return false;
+    }
+
+    HSAResourceManager myHsa;
+
+    // Kernel timestamps are needed to report the execution time
+    if (!myHsa.CreateDefaultQueue(true))
+    {
+        std::cerr << "RunReplay(): Error on creating default queue.\n";
+        return false;
+    }
+
+    // Executable of every code object in the capture, each one is loaded once
+    std::unordered_map<uint32_t, hsa_executable_t> executables;
+    CapturedDispatch dispatch;
+    unsigned int dispatchIndex = 0;
+    bool ret = true;
+
+    while (ret && reader.ReadDispatch(dispatch))
+    {
+        std::unordered_map<uint32_t, hsa_executable_t>::iterator iter = executables.find(dispatch.m_codeObjectId);
+
+        if (executables.end() == iter)
+        {
+            hsa_executable_t executable = {0};
+            const std::vector<char>& codeObject = *dispatch.m_pCodeObject;
+
+            if (!myHsa.CreateExecutableFromCodeObject(codeObject.data(), codeObject.size(), executable))
+            {
+                std::cerr << "Error in RunReplay(): Cannot load code object " << dispatch.m_codeObjectId << ".\n";
+                ret = false;
+                break;
+            }
+
+            iter = executables.insert(std::make_pair(dispatch.m_codeObjectId, executable)).first;
+        }
+
+        std::cout << "Dispatch " << dispatchIndex << ": " << dispatch.m_kernelSymbol
+                  << ", grid {" << dispatch.m_aql.grid_size_x << " " << dispatch.m_aql.grid_size_y << " " << dispatch.m_aql.grid_size_z << "}"
+                  << ", work-group {" << dispatch.m_aql.workgroup_size_x << " " << dispatch.m_aql.workgroup_size_y << " " << dispatch.m_aql.workgroup_size_z << "}\n";
+
+        ret = ReplayDispatch(myHsa, dispatch, iter->second, iterationCount);
+        ++dispatchIndex;
+    }
+
+    if (ret && reader.Failed())
+    {
+        std::cerr << "Error in RunReplay(): Cannot read all the dispatches of \"" << captureFile << "\".\n";
+        ret = false;
+    }
+    else if (ret && 0 == dispatchIndex)
+    {
+        std::cerr << "Error in RunReplay(): \"" << captureFile << "\" has no dispatch.\n";
+        ret = false;
+    }
+
+    myHsa.CleanUp();
+    myHsa.DestroyQueue();
+
+    HSAResourceManager::ShutDown();
+
+    return ret;
+}
+
+bool ReplayDispatch(AMDT::HSAResourceManager& myHsa, const AMDT::CapturedDispatch& dispatch,
+                    const hsa_executable_t& executable, unsigned int iterationCount)
+{
+    using namespace AMDT;
+
+    hsa_kernel_dispatch_packet_t aql;
+
+    if (!myHsa.CreateAQLFromExecutable(executable, dispatch.m_kernelSymbol, true, aql, dispatch.m_kernargStartOffset))
+    {
+        std::cerr << "ReplayDispatch(): Error in creating AQL packet.\n";
+        return false;
+    }
+
+    // Setup AQL packet as it was captured
+    aql.setup = dispatch.m_aql.setup;
+    aql.workgroup_size_x = dispatch.m_aql.workgroup_size_x;
+    aql.workgroup_size_y = dispatch.m_aql.workgroup_size_y;
+    aql.workgroup_size_z = dispatch.m_aql.workgroup_size_z;
+    aql.grid_size_x = dispatch.m_aql.grid_size_x;
+    aql.grid_size_y = dispatch.m_aql.grid_size_y;
+    aql.grid_size_z = dispatch.m_aql.grid_size_z;
+    aql.group_segment_size = dispatch.m_aql.group_segment_size;
+
+    HSAKernelArgBuffer& kernArgBuffer = myHsa.GetAqlInfo(aql).m_kernArgBuffer;
+
+    if (kernArgBuffer.GetBufferSize() != dispatch.m_kernarg.size())
+    {
+        std::cerr << "ReplayDispatch(): Kernel argument size " << kernArgBuffer.GetBufferSize()
+                  << " does not match the captured size " << dispatch.m_kernarg.size() << ".\n";
+        return false;
+    }
+
+    unsigned char* pKernarg = reinterpret_cast<unsigned char*>(kernArgBuffer.GetArgBufferPointer());
+
+    if (!dispatch.m_kernarg.empty())
+    {
+        memcpy(pKernarg, dispatch.m_kernarg.data(), dispatch.m_kernarg.size());
+    }
+
+    // Allocate the buffers and point the kernel arguments to them
+    bool ret = true;
+    std::vector<void*> buffers(dispatch.m_buffers.size(), nullptr);
+
+    for (std::size_t i = 0; ret && i < dispatch.m_buffers.size(); ++i)
+    {
+        // Same kind of memory as when the dispatch was captured, so that the kernel time is comparable
+        const CapturedBuffer& capturedBuffer = dispatch.m_buffers[i];
+        buffers[i] = (CAPTURE_MEMORY_COARSE_LOCAL == capturedBuffer.m_memoryKind) ?
+                     HSAResourceManager::AllocateCoarseLocalMemory(capturedBuffer.m_data.size(), myHsa.GPUIndex()) :
+                     HSAResourceManager::AllocateSysMemory(capturedBuffer.m_data.size(), myHsa.GPUIndex());
+
+        if (nullptr == buffers[i])
+        {
+            std::cerr << "ReplayDispatch(): Cannot allocate buffer " << i << " of " << capturedBuffer.m_data.size() << " bytes.\n";
+            ret = false;
+            break;
+        }
+
+        for (std::size_t j = 0; j < capturedBuffer.m_argOffsets.size(); ++j)
+        {
+            if (capturedBuffer.m_argOffsets[j] + sizeof(void*) > dispatch.m_kernarg.size())
+            {
+                std::cerr << "ReplayDispatch(): Invalid kernel argument offset " << capturedBuffer.m_argOffsets[j] << ".\n";
+                ret = false;
+                break;
+            }
+
+            memcpy(pKernarg + capturedBuffer.m_argOffsets[j], &buffers[i], sizeof(void*));
+        }
+    }
+
+    myHsa.EnableDispatchTiming(true);
+
+    for (unsigned int iteration = 0; ret && iteration < iterationCount; ++iteration)
+    {
+        // Every iteration starts from the captured buffer contents
+        for (std::size_t i = 0; ret && i < buffers.size(); ++i)
+        {
+            const std::vector<char>& data = dispatch.m_buffers[i].m_data;
+
+            if (data.empty())
+            {
+                continue;
+            }
+
+            if (CAPTURE_MEMORY_COARSE_LOCAL == dispatch.m_buffers[i].m_memoryKind)
+            {
+                ret = HSAResourceManager::CopyHSAMemory(buffers[i], data.data(), data.size(), true, myHsa.GPUIndex());
+            }
+            else
+            {
+                memcpy(buffers[i], data.data(), data.size());
+            }
+        }
+
+        if (!ret)
+        {
+            std::cerr << "ReplayDispatch(): Cannot restore the captured buffer contents.\n";
+            break;
+        }
+
+        hsa_signal_store_relaxed(aql.completion_signal, 1);
+
+        if (!myHsa.Dispatch(aql))
+        {
+            std::cerr << "ReplayDispatch(): Error on Dispatch()\n";
+            ret = false;
+            break;
+        }
+
+        if (!myHsa.WaitForCompletion(aql.completion_signal))
+        {
+            std::cerr << "Error in ReplayDispatch(): Signal return error.\n";
+            ret = false;
+            break;
+        }
+
+        // The timing record has to be collected before the signal is reset
+        myHsa.WaitForDispatchTimings();
+    }
+
+    myHsa.EnableDispatchTiming(false);
+
+    std::vector<DispatchTiming> timings;
+    myHsa.GetDispatchTimings(timings);
+
+    if (ret && !timings.empty())
+    {
+        uint64_t minTime = UINT64_MAX;
+        uint64_t totalTime = 0;
+
+        for (std::size_t i = 0; i < timings.size(); ++i)
+        {
+            uint64_t kernelTime = timings[i].m_gpuEnd - timings[i].m_gpuStart;
+
+            if (0 == timings[i].m_gpuEnd)
+            {
+                // No GPU timestamps, fall back to the host side time
+                kernelTime = timings[i].m_hostComplete - timings[i].m_hostEnqueue;
+            }
+
+            minTime = (kernelTime < minTime) ? kernelTime : minTime;
+            totalTime += kernelTime;
+        }
+
+        std::cout << "\t" << timings.size() << " iterations, kernel execution time min "
+                  << minTime / 1e3 << " us, mean " << (totalTime / timings.size()) / 1e3 << " us\n";
+    }
+
+    for (std::size_t i = 0; i < buffers.size(); ++i)
+    {
+        HSAResourceManager::FreeHSAMemory(buffers[i]);
+    }
+
+    // Release the per packet resources, the next dispatch can reuse the same aql address
+    myHsa.DeregisterKernelArgsBuffer(aql);
+    myHsa.DestroySignal(aql.completion_signal);
+
+    return ret;
+}
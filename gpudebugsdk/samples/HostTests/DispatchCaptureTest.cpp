@@ -0,0 +1,400 @@
+//==============================================================================
+// Copyright (c) 2017 Advanced Micro Devices, Inc. All rights reserved.
+//
+/// \author AMD Developer Tools
+/// \file
+/// \brief  Round trip of a dispatch through HSADispatchCapture and
+///         DispatchCaptureReader on the CPU-side stand-in runtime, then
+///         replay of the captured code object.  Truncated and corrupted
+///         capture files must be reported as failed, never read past.
+//==============================================================================
+#include <cstdio>    // remove
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <hsa.h>
+
+#include "HSAResourceManager.h"
+#include "HSADispatchCapture.h"
+#include "HSAHostRuntime.h"
+
+/// Stand-in BRIG module, see HSAHostRuntime.h. 48 bytes of hidden arguments and 3 pointers.
+static const char gs_KERNEL_MODULE[] = "&__CaptureTest_kernel 72";
+static const std::string gs_KERNEL_SYMBOL = "&__CaptureTest_kernel";
+
+static const std::string gs_CAPTURE_FILE = "DispatchCaptureTest.cap";
+static const std::string gs_CORRUPT_FILE = "DispatchCaptureTest.corrupt.cap";
+
+static const std::size_t gs_SYSTEM_BUFFER_SIZE = 100;
+static const std::size_t gs_LOCAL_BUFFER_SIZE = 40;
+
+// Size of the capture file magic, and of the type and payload size in front of every record
+static const std::size_t gs_MAGIC_SIZE = 8;
+static const std::size_t gs_RECORD_HEADER_SIZE = sizeof(uint32_t) + sizeof(uint64_t);
+
+// ================================= Functions declaration ============================================
+
+// Capture two dispatches of the same code object and check what is read back, then replay it.
+bool TestRoundTrip(AMDT::HSAResourceManager& myHsa, std::vector<char>& captureOut);
+
+// Check that every truncation of the capture file is detected, except at a record boundary.
+bool TestTruncatedFiles(const std::vector<char>& capture);
+
+// Check that records and counts larger than the capture file are detected.
+bool TestOversizedRecords(const std::vector<char>& capture);
+
+// Helper function to write bytes to fileName and read all of its dispatches back.
+bool ReadCapture(const std::string& fileName, const std::vector<char>& bytes, unsigned int& dispatchCountOut);
+
+// Helper function to print the result of a check.
+bool Check(bool condition, const std::string& description);
+
+// Helper function to load binary file into data.
+bool LoadFile(const std::string& fileName, std::vector<char>& data);
+
+// =====================================================================================================
+
+int main(int argc, char** argv)
+{
+    using namespace AMDT;
+
+    (void)argc;
+    (void)argv;
+
+    if (true != HSAResourceManager::InitRuntime(false))
+    {
+        std::cerr << "main(): HSA runtime initialization fail, exiting...\n";
+        return 1;
+    }
+
+    bool ret = true;
+
+    {
+        HSAResourceManager myHsa;
+
+        if (!myHsa.CreateDefaultQueue())
+        {
+            std::cerr << "main(): Error on creating default queue.\n";
+            return 1;
+        }
+
+        std::vector<char> capture;
+        ret = TestRoundTrip(myHsa, capture);
+
+        if (ret)
+        {
+            ret &= TestTruncatedFiles(capture);
+            ret &= TestOversizedRecords(capture);
+        }
+
+        myHsa.CleanUp();
+        myHsa.DestroyQueue();
+    }
+
+    HSAResourceManager::ShutDown();
+
+    // The capture file is left for DispatchReplay
+    remove(gs_CORRUPT_FILE.c_str());
+
+    std::cout << (ret ? "DispatchCaptureTest passed.\n" : "DispatchCaptureTest FAILED.\n");
+    return ret ? 0 : 1;
+}
+
+bool TestRoundTrip(AMDT::HSAResourceManager& myHsa, std::vector<char>& captureOut)
+{
+    using namespace AMDT;
+
+    hsa_kernel_dispatch_packet_t aql;
+
+    if (!myHsa.CreateAQLPacketFromBrig(gs_KERNEL_MODULE, gs_KERNEL_SYMBOL, true, aql))
+    {
+        std::cerr << "TestRoundTrip(): Error in creating AQL packet.\n";
+        return false;
+    }
+
+    aql.grid_size_x = 256;
+    aql.workgroup_size_x = 64;
+
+    // A system buffer passed twice and a device local buffer in between
+    unsigned char* pSystem = reinterpret_cast<unsigned char*>(HSAResourceManager::AllocateSysMemory(gs_SYSTEM_BUFFER_SIZE));
+    void* pLocal = HSAResourceManager::AllocateCoarseLocalMemory(gs_LOCAL_BUFFER_SIZE);
+    std::vector<char> localData(gs_LOCAL_BUFFER_SIZE);
+
+    if (nullptr == pSystem || nullptr == pLocal)
+    {
+        std::cerr << "TestRoundTrip(): Cannot allocate the buffers.\n";
+        return false;
+    }
+
+    for (std::size_t i = 0; i < gs_SYSTEM_BUFFER_SIZE; ++i)
+    {
+        pSystem[i] = static_cast<unsigned char>(i * 7);
+    }
+
+    for (std::size_t i = 0; i < gs_LOCAL_BUFFER_SIZE; ++i)
+    {
+        localData[i] = static_cast<char>(200 - i);
+    }
+
+    bool ret = HSAResourceManager::CopyHSAMemory(pLocal, localData.data(), gs_LOCAL_BUFFER_SIZE, true) &&
+               myHsa.AppendKernelArgs(&pSystem, sizeof(pSystem), aql) &&
+               myHsa.AppendKernelArgs(&pLocal, sizeof(pLocal), aql) &&
+               myHsa.AppendKernelArgs(&pSystem, sizeof(pSystem), aql);
+
+    std::vector<DispatchCaptureBuffer> buffers;
+    buffers.push_back(DispatchCaptureBuffer(pSystem, gs_SYSTEM_BUFFER_SIZE, CAPTURE_MEMORY_SYSTEM));
+    buffers.push_back(DispatchCaptureBuffer(pLocal, gs_LOCAL_BUFFER_SIZE, CAPTURE_MEMORY_COARSE_LOCAL));
+
+    // The second dispatch must see the buffer as it was when it was captured
+    {
+        HSADispatchCapture capture;
+        ret = ret && capture.Open(gs_CAPTURE_FILE) && capture.CaptureDispatch(myHsa, aql, buffers);
+        pSystem[0] = 0xAB;
+        ret = ret && capture.CaptureDispatch(myHsa, aql, buffers) && capture.Close();
+    }
+
+    ret = Check(ret, "capture two dispatches");
+
+    const std::vector<char> kernarg(reinterpret_cast<const char*>(aql.kernarg_address),
+                                    reinterpret_cast<const char*>(aql.kernarg_address) + myHsa.GetAqlInfo(aql).m_kernArgBuffer.GetBufferSize());
+
+    DispatchCaptureReader reader;
+    CapturedDispatch dispatches[2];
+    CapturedDispatch extraDispatch;
+
+    ret = ret && Check(reader.Open(gs_CAPTURE_FILE), "open the capture file");
+    ret = ret && Check(reader.ReadDispatch(dispatches[0]) && reader.ReadDispatch(dispatches[1]), "read two dispatches back");
+    ret = ret && Check(!reader.ReadDispatch(extraDispatch) && !reader.Failed(), "end of the capture file after two dispatches");
+
+    for (unsigned int i = 0; ret && i < 2; ++i)
+    {
+        const CapturedDispatch& dispatch = dispatches[i];
+        std::vector<char> systemData(pSystem, pSystem + gs_SYSTEM_BUFFER_SIZE);
+        systemData[0] = (0 == i) ? 0 : static_cast<char>(0xAB);
+
+        ret &= Check(dispatch.m_codeObjectId == dispatches[0].m_codeObjectId &&
+                     dispatch.m_pCodeObject == dispatches[0].m_pCodeObject, "code object stored once");
+        ret &= Check(std::string(dispatch.m_pCodeObject->begin(), dispatch.m_pCodeObject->end()).find(gs_KERNEL_MODULE) != std::string::npos,
+                     "code object contents");
+        ret &= Check(dispatch.m_kernelSymbol == gs_KERNEL_SYMBOL, "kernel symbol");
+        ret &= Check(256 == dispatch.m_aql.grid_size_x && 64 == dispatch.m_aql.workgroup_size_x, "aql packet");
+        ret &= Check(sizeof(uint64_t) * 6 == dispatch.m_kernargStartOffset && kernarg == dispatch.m_kernarg, "kernel arguments");
+        ret &= Check(2 == dispatch.m_buffers.size(), "buffer count");
+
+        if (ret)
+        {
+            const CapturedBuffer& system = dispatch.m_buffers[0];
+            const CapturedBuffer& local = dispatch.m_buffers[1];
+
+            ret &= Check(CAPTURE_MEMORY_SYSTEM == system.m_memoryKind && systemData == system.m_data, "system buffer");
+            ret &= Check(2 == system.m_argOffsets.size() && 48 == system.m_argOffsets[0] && 64 == system.m_argOffsets[1],
+                         "system buffer argument offsets");
+            ret &= Check(CAPTURE_MEMORY_COARSE_LOCAL == local.m_memoryKind && localData == local.m_data, "device local buffer");
+            ret &= Check(1 == local.m_argOffsets.size() && 56 == local.m_argOffsets[0], "device local buffer argument offsets");
+        }
+    }
+
+    // Replay the captured code object as DispatchReplay does
+    if (ret)
+    {
+        const CapturedDispatch& dispatch = dispatches[0];
+        hsa_executable_t executable = {0};
+        hsa_kernel_dispatch_packet_t replayAql;
+
+        ret = Check(myHsa.CreateExecutableFromCodeObject(dispatch.m_pCodeObject->data(), dispatch.m_pCodeObject->size(), executable) &&
+                    myHsa.CreateAQLFromExecutable(executable, dispatch.m_kernelSymbol, true, replayAql, dispatch.m_kernargStartOffset) &&
+                    myHsa.GetAqlInfo(replayAql).m_kernArgBuffer.GetBufferSize() == dispatch.m_kernarg.size(),
+                    "load the captured code object");
+
+        if (ret)
+        {
+            memcpy(replayAql.kernarg_address, dispatch.m_kernarg.data(), dispatch.m_kernarg.size());
+            ret = Check(myHsa.Dispatch(replayAql) && myHsa.WaitForCompletion(replayAql.completion_signal), "replay the dispatch");
+        }
+    }
+
+    HSAResourceManager::FreeHSAMemory(pSystem);
+    HSAResourceManager::FreeHSAMemory(pLocal);
+
+    return ret && Check(LoadFile(gs_CAPTURE_FILE, captureOut), "load the capture file");
+}
+
+bool TestTruncatedFiles(const std::vector<char>& capture)
+{
+    // Dispatches complete before every record boundary
+    std::vector<std::size_t> boundaries;
+    std::vector<unsigned int> boundaryDispatchCounts;
+    unsigned int dispatchCount = 0;
+
+    for (std::size_t pos = gs_MAGIC_SIZE; pos + gs_RECORD_HEADER_SIZE <= capture.size();)
+    {
+        uint32_t type = 0;
+        uint64_t payloadSize = 0;
+        memcpy(&type, &capture[pos], sizeof(type));
+        memcpy(&payloadSize, &capture[pos + sizeof(type)], sizeof(payloadSize));
+
+        pos += gs_RECORD_HEADER_SIZE + payloadSize;
+        dispatchCount += (2 == type) ? 1 : 0;
+        boundaries.push_back(pos);
+        boundaryDispatchCounts.push_back(dispatchCount);
+    }
+
+    bool ret = Check(!boundaries.empty() && capture.size() == boundaries.back() && 2 == dispatchCount, "capture file layout");
+
+    for (std::size_t size = gs_MAGIC_SIZE; ret && size < capture.size(); ++size)
+    {
+        unsigned int expectedCount = 0;
+        bool isBoundary = (gs_MAGIC_SIZE == size);
+
+        for (std::size_t i = 0; i < boundaries.size() && boundaries[i] <= size; ++i)
+        {
+            expectedCount = boundaryDispatchCounts[i];
+            isBoundary = (boundaries[i] == size);
+        }
+
+        std::vector<char> truncated(capture.begin(), capture.begin() + size);
+        unsigned int readCount = 0;
+        bool failed = !ReadCapture(gs_CORRUPT_FILE, truncated, readCount);
+
+        if (failed == isBoundary || readCount != expectedCount)
+        {
+            std::ostringstream description;
+            description << "capture file truncated to " << size << " bytes";
+            ret = Check(false, description.str());
+        }
+    }
+
+    return Check(ret, "every truncated capture file");
+}
+
+bool TestOversizedRecords(const std::vector<char>& capture)
+{
+    // Records: code object, first dispatch, second dispatch
+    uint64_t codeObjectSize = 0;
+    memcpy(&codeObjectSize, &capture[gs_MAGIC_SIZE + sizeof(uint32_t)], sizeof(codeObjectSize));
+
+    const std::size_t firstDispatch = gs_MAGIC_SIZE + gs_RECORD_HEADER_SIZE + codeObjectSize;
+    const std::size_t payload = firstDispatch + gs_RECORD_HEADER_SIZE;
+
+    uint64_t firstDispatchSize = 0;
+    memcpy(&firstDispatchSize, &capture[firstDispatch + sizeof(uint32_t)], sizeof(firstDispatchSize));
+
+    const std::size_t secondDispatch = payload + firstDispatchSize;
+
+    // Fields of the first dispatch payload
+    uint32_t symbolLength = 0;
+    memcpy(&symbolLength, &capture[payload + sizeof(uint32_t)], sizeof(symbolLength));
+
+    const std::size_t kernargSizePos = payload + sizeof(uint32_t) * 2 + symbolLength + sizeof(hsa_kernel_dispatch_packet_t) + sizeof(uint64_t);
+    uint64_t kernargSize = 0;
+    memcpy(&kernargSize, &capture[kernargSizePos], sizeof(kernargSize));
+
+    const std::size_t bufferCountPos = kernargSizePos + sizeof(uint64_t) + kernargSize;
+    const std::size_t bufferSizePos = bufferCountPos + sizeof(uint32_t);
+    const std::size_t memoryKindPos = bufferSizePos + sizeof(uint64_t);
+    const std::size_t argCountPos = memoryKindPos + sizeof(uint32_t);
+
+    const struct
+    {
+        const char* m_description;
+        std::size_t m_pos;
+        std::size_t m_size;
+        uint64_t    m_value;
+        unsigned int m_expectedCount;
+    } cases[] =
+    {
+        { "record larger than the file",       secondDispatch + sizeof(uint32_t), sizeof(uint64_t), capture.size(),     1 },
+        { "record of 2^63 bytes",               secondDispatch + sizeof(uint32_t), sizeof(uint64_t), 1ULL << 63,         1 },
+        { "record shorter than its contents",   firstDispatch + sizeof(uint32_t),  sizeof(uint64_t), firstDispatchSize - 1, 0 },
+        { "kernel symbol larger than record",   payload + sizeof(uint32_t),        sizeof(uint32_t), 0xFFFFFFFF,         0 },
+        { "kernel arguments larger than record", kernargSizePos,                   sizeof(uint64_t), UINT64_MAX,         0 },
+        { "buffer count larger than record",    bufferCountPos,                    sizeof(uint32_t), 0xFFFFFFFF,         0 },
+        { "buffer larger than record",          bufferSizePos,                     sizeof(uint64_t), UINT64_MAX - 7,     0 },
+        { "invalid buffer memory kind",         memoryKindPos,                     sizeof(uint32_t), 7,                  0 },
+        { "argument count larger than record",  argCountPos,                       sizeof(uint32_t), 0x20000000,         0 },
+    };
+
+    bool ret = true;
+
+    for (std::size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+    {
+        std::vector<char> corrupted(capture);
+        memcpy(&corrupted[cases[i].m_pos], &cases[i].m_value, cases[i].m_size);
+
+        unsigned int readCount = 0;
+        bool failed = !ReadCapture(gs_CORRUPT_FILE, corrupted, readCount);
+        ret &= Check(failed && cases[i].m_expectedCount == readCount, cases[i].m_description);
+    }
+
+    std::vector<char> badMagic(capture);
+    badMagic[0] = 'X';
+    unsigned int readCount = 0;
+    ret &= Check(!ReadCapture(gs_CORRUPT_FILE, badMagic, readCount) && 0 == readCount, "invalid magic");
+
+    return ret;
+}
+
+bool ReadCapture(const std::string& fileName, const std::vector<char>& bytes, unsigned int& dispatchCountOut)
+{
+    dispatchCountOut = 0;
+
+    {
+        std::ofstream file(fileName, std::ios::binary | std::ios::trunc);
+        file.write(bytes.data(), bytes.size());
+
+        if (!file.good())
+        {
+            std::cerr << "Error in ReadCapture(): Cannot write file \"" << fileName << "\"\n";
+            return false;
+        }
+    }
+
+    // The errors reported by the reader are expected
+    std::ostringstream errors;
+    std::streambuf* pCerrBuffer = std::cerr.rdbuf(errors.rdbuf());
+
+    AMDT::DispatchCaptureReader reader;
+    AMDT::CapturedDispatch dispatch;
+    bool ret = reader.Open(fileName);
+
+    while (ret && reader.ReadDispatch(dispatch))
+    {
+        ++dispatchCountOut;
+    }
+
+    ret = ret && !reader.Failed();
+
+    std::cerr.rdbuf(pCerrBuffer);
+    return ret;
+}
+
+bool Check(bool condition, const std::string& description)
+{
+    if (!condition)
+    {
+        std::cout << "FAILED: " << description << "\n";
+    }
+
+    return condition;
+}
+
+bool LoadFile(const std::string& fileName, std::vector<char>& data)
+{
+    std::ifstream file(fileName, std::ios::binary | std::ios::ate);
+
+    if (!file.is_open())
+    {
+        std::cerr << "Error in LoadFile(): Cannot open file \"" << fileName << "\"\n";
+        return false;
+    }
+
+    data.resize(static_cast<std::size_t>(file.tellg()));
+    file.seekg(0);
+    file.read(data.data(), data.size());
+
+    return file.good();
+}
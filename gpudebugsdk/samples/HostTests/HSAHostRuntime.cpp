@@ -0,0 +1,1140 @@
+//==============================================================================
+// Copyright (c) 2017 Advanced Micro Devices, Inc. All rights reserved.
+//
+/// \author AMD Developer Tools
+/// \file
+/// \brief  CPU-side stand-in for the part of the HSA runtime used by the
+///         samples, see HSAHostRuntime.h.
+//==============================================================================
+#include <atomic>
+#include <chrono>
+#include <cstdlib>   // posix_memalign, free
+#include <cstring>   // memcpy, strncpy
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <hsa.h>
+#include <hsa_ext_amd.h>
+#include <hsa_ext_finalize.h>
+
+#include "HSAHostRuntime.h"
+
+namespace AMDT
+{
+
+// Handles of the agents, memory regions and ISA of the stand-in
+static const uint64_t gs_GPU_AGENT = 1;
+static const uint64_t gs_CPU_AGENT = 2;
+static const uint64_t gs_GPU_COARSE_REGION = 1;
+static const uint64_t gs_GPU_KERNARG_REGION = 2;
+static const uint64_t gs_CPU_SYSTEM_REGION = 3;
+static const uint64_t gs_ISA = 1;
+
+// Frequency of the system timestamps, in ticks per second
+static const uint64_t gs_TIMESTAMP_FREQUENCY = 1000000000;
+
+// Alignment of the memory allocations and of the queue ring buffers
+static const std::size_t gs_ALLOCATION_ALIGNMENT = 64;
+
+/// \brief A handler registered with hsa_amd_signal_async_handler()
+typedef struct HostSignalHandler
+{
+    hsa_signal_condition_t m_condition;
+    hsa_signal_value_t     m_compareValue;
+    hsa_amd_signal_handler m_handler;
+    void*                  m_pArg;
+} HostSignalHandler;
+
+/// \brief A signal, its handle is the address of this structure
+typedef struct HostSignal
+{
+    std::atomic<hsa_signal_value_t> m_value;
+    std::mutex                      m_handlersMutex; ///< protect m_handlers
+    std::vector<HostSignalHandler>  m_handlers;      ///< handlers waiting for their condition
+
+    explicit HostSignal(hsa_signal_value_t value) : m_value(value)
+    {}
+} HostSignal;
+
+/// \brief A queue, m_queue is handed out to the application and the rest is hidden behind it
+typedef struct HostQueue
+{
+    hsa_queue_t           m_queue;        ///< must stay the first member
+    std::atomic<uint64_t> m_writeIndex;
+    std::atomic<uint64_t> m_readIndex;
+    std::atomic<bool>     m_isProfiling;  ///< record the dispatch times of the packets
+    std::atomic<bool>     m_isDestroyed;  ///< tell the packet processor to exit
+    std::thread           m_processor;    ///< thread consuming the packets
+
+    HostQueue() : m_writeIndex(0), m_readIndex(0), m_isProfiling(false), m_isDestroyed(false)
+    {
+        memset(&m_queue, 0, sizeof(m_queue));
+    }
+} HostQueue;
+
+/// \brief A finalized kernel, its handle is the address of this structure
+typedef struct HostSymbol
+{
+    std::string m_name;
+    uint32_t    m_kernargSize;
+} HostSymbol;
+
+/// \brief A program being finalized
+typedef struct HostProgram
+{
+    hsa_machine_model_t               m_machineModel;
+    hsa_profile_t                     m_profile;
+    hsa_default_float_rounding_mode_t m_roundingMode;
+    std::vector<hsa_ext_module_t>     m_modules;
+} HostProgram;
+
+/// \brief A code object, holding the kernel descriptions of the modules it was finalized from
+typedef struct HostCodeObject
+{
+    std::string m_kernels;
+} HostCodeObject;
+
+/// \brief An executable and the kernels of its loaded code objects
+typedef struct HostExecutable
+{
+    hsa_profile_t          m_profile;
+    bool                   m_isFrozen;
+    std::deque<HostSymbol> m_symbols;   ///< a deque, the symbol handles point to the elements
+} HostExecutable;
+
+static std::atomic<int>   gs_initCount(0);
+static HostPacketCallback gs_packetCallback = nullptr;
+static void*              gs_pPacketCallbackData = nullptr;
+
+// Dispatch times of the packets of the profiling queues, by completion signal
+static std::mutex                                                       gs_dispatchTimesMutex;
+static std::unordered_map<uint64_t, hsa_amd_profiling_dispatch_time_t> gs_dispatchTimes;
+
+void SetHostPacketCallback(HostPacketCallback callback, void* pData)
+{
+    gs_packetCallback = callback;
+    gs_pPacketCallbackData = pData;
+}
+
+static uint64_t HostTicks()
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                     std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+static HostSignal* ToHostSignal(hsa_signal_t signal)
+{
+    return reinterpret_cast<HostSignal*>(signal.handle);
+}
+
+static HostQueue* ToHostQueue(const hsa_queue_t* pQueue)
+{
+    return reinterpret_cast<HostQueue*>(const_cast<hsa_queue_t*>(pQueue));
+}
+
+static bool SignalConditionHolds(hsa_signal_condition_t condition, hsa_signal_value_t value, hsa_signal_value_t compareValue)
+{
+    switch (condition)
+    {
+        case HSA_SIGNAL_CONDITION_EQ:
+            return value == compareValue;
+
+        case HSA_SIGNAL_CONDITION_NE:
+            return value != compareValue;
+
+        case HSA_SIGNAL_CONDITION_LT:
+            return value < compareValue;
+
+        case HSA_SIGNAL_CONDITION_GTE:
+            return value >= compareValue;
+
+        default:
+            return false;
+    }
+}
+
+// Change the value of a signal and call the handlers whose condition now holds, on the
+// thread which changed the signal. The value is changed under m_handlersMutex, which
+// hsa_signal_destroy() takes, so that a waiter cannot destroy the signal while it is used here.
+// A handler returning true stays registered, as with the HSA runtime.
+static void ChangeSignal(hsa_signal_t signal, hsa_signal_value_t value, bool isAdd, std::memory_order order)
+{
+    HostSignal* pSignal = ToHostSignal(signal);
+    std::vector<HostSignalHandler> readyHandlers;
+
+    {
+        std::lock_guard<std::mutex> lock(pSignal->m_handlersMutex);
+
+        if (isAdd)
+        {
+            value += pSignal->m_value.fetch_add(value, order);
+        }
+        else
+        {
+            pSignal->m_value.store(value, order);
+        }
+
+        for (std::size_t i = 0; i < pSignal->m_handlers.size();)
+        {
+            if (SignalConditionHolds(pSignal->m_handlers[i].m_condition, value, pSignal->m_handlers[i].m_compareValue))
+            {
+                readyHandlers.push_back(pSignal->m_handlers[i]);
+                pSignal->m_handlers.erase(pSignal->m_handlers.begin() + i);
+            }
+            else
+            {
+                ++i;
+            }
+        }
+    }
+
+    for (std::size_t i = 0; i < readyHandlers.size(); ++i)
+    {
+        if (readyHandlers[i].m_handler(value, readyHandlers[i].m_pArg))
+        {
+            std::lock_guard<std::mutex> lock(pSignal->m_handlersMutex);
+            pSignal->m_handlers.push_back(readyHandlers[i]);
+        }
+    }
+}
+
+static hsa_signal_value_t WaitSignal(hsa_signal_t signal, hsa_signal_condition_t condition, hsa_signal_value_t compareValue,
+                                     uint64_t timeoutHint, std::memory_order order)
+{
+    HostSignal* pSignal = ToHostSignal(signal);
+    const uint64_t start = HostTicks();
+    hsa_signal_value_t value = pSignal->m_value.load(order);
+
+    while (!SignalConditionHolds(condition, value, compareValue) &&
+           (UINT64_MAX == timeoutHint || HostTicks() - start < timeoutHint))
+    {
+        std::this_thread::yield();
+        value = pSignal->m_value.load(order);
+    }
+
+    return value;
+}
+
+// Body of the packet processor thread of a queue. Packets are consumed in order once their
+// header is valid, then the slot is released and the read index moved. As with the GPU, the
+// doorbell only wakes the processor up: with several producers its value can go backwards.
+static void ProcessPackets(HostQueue* pHostQueue)
+{
+    hsa_queue_t& queue = pHostQueue->m_queue;
+    HostSignal* pDoorbell = ToHostSignal(queue.doorbell_signal);
+    hsa_kernel_dispatch_packet_t* pSlots = reinterpret_cast<hsa_kernel_dispatch_packet_t*>(queue.base_address);
+    uint64_t packetId = 0;
+
+    while (!pHostQueue->m_isDestroyed.load(std::memory_order_acquire))
+    {
+        // Read before the header, a packet published after it is rung after it
+        const hsa_signal_value_t doorbell = pDoorbell->m_value.load(std::memory_order_acquire);
+
+        hsa_kernel_dispatch_packet_t* pSlot = pSlots + (packetId & (queue.size - 1));
+        uint32_t headerAndSetup = __atomic_load_n(reinterpret_cast<uint32_t*>(pSlot), __ATOMIC_ACQUIRE);
+        uint32_t packetType = (headerAndSetup >> HSA_PACKET_HEADER_TYPE) & ((1 << HSA_PACKET_HEADER_WIDTH_TYPE) - 1);
+
+        if (HSA_PACKET_TYPE_INVALID == packetType)
+        {
+            // Sleep until the doorbell is rung again
+            while (doorbell == pDoorbell->m_value.load(std::memory_order_acquire) &&
+                   !pHostQueue->m_isDestroyed.load(std::memory_order_acquire))
+            {
+                std::this_thread::yield();
+            }
+
+            continue;
+        }
+
+        hsa_kernel_dispatch_packet_t packet;
+        memcpy(reinterpret_cast<char*>(&packet) + sizeof(uint32_t),
+               reinterpret_cast<const char*>(pSlot) + sizeof(uint32_t),
+               sizeof(packet) - sizeof(uint32_t));
+        packet.header = static_cast<uint16_t>(headerAndSetup);
+        packet.setup = static_cast<uint16_t>(headerAndSetup >> 16);
+
+        const uint64_t start = HostTicks();
+
+        if (nullptr != gs_packetCallback)
+        {
+            gs_packetCallback(&queue, packetId, packet, pSlot, gs_pPacketCallbackData);
+        }
+
+        const uint64_t end = HostTicks();
+
+        // The slot is invalid again before the producers can see the read index move past it
+        __atomic_store_n(&pSlot->header, static_cast<uint16_t>(HSA_PACKET_TYPE_INVALID << HSA_PACKET_HEADER_TYPE), __ATOMIC_RELAXED);
+        pHostQueue->m_readIndex.store(packetId + 1, std::memory_order_release);
+        ++packetId;
+
+        // The completion signal is at the same offset in the kernel dispatch and barrier packets
+        if (0 != packet.completion_signal.handle)
+        {
+            if (pHostQueue->m_isProfiling.load(std::memory_order_relaxed))
+            {
+                hsa_amd_profiling_dispatch_time_t dispatchTime;
+                dispatchTime.start = start;
+                dispatchTime.end = end;
+
+                std::lock_guard<std::mutex> lock(gs_dispatchTimesMutex);
+                gs_dispatchTimes[packet.completion_signal.handle] = dispatchTime;
+            }
+
+            ChangeSignal(packet.completion_signal, -1, true, std::memory_order_release);
+        }
+    }
+}
+
+// Parse the "<kernel symbol> <kernarg segment size>" pairs of a module or code object
+static bool ParseKernels(const std::string& kernels, std::deque<HostSymbol>& symbolsOut)
+{
+    std::istringstream stream(kernels);
+    HostSymbol symbol;
+
+    while (stream >> symbol.m_name)
+    {
+        if (!(stream >> symbol.m_kernargSize))
+        {
+            return false;
+        }
+
+        symbolsOut.push_back(symbol);
+    }
+
+    return !symbolsOut.empty();
+}
+
+// ------------------ Finalizer extension ------------------------
+
+static hsa_status_t HostProgramCreate(hsa_machine_model_t               machineModel,
+                                      hsa_profile_t                     profile,
+                                      hsa_default_float_rounding_mode_t roundingMode,
+                                      const char*                       pOptions,
+                                      hsa_ext_program_t*                pProgram)
+{
+    (void)pOptions;
+
+    if (nullptr == pProgram)
+    {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+
+    HostProgram* pHostProgram = new HostProgram;
+    pHostProgram->m_machineModel = machineModel;
+    pHostProgram->m_profile = profile;
+    pHostProgram->m_roundingMode = roundingMode;
+    pProgram->handle = reinterpret_cast<uint64_t>(pHostProgram);
+    return HSA_STATUS_SUCCESS;
+}
+
+static hsa_status_t HostProgramDestroy(hsa_ext_program_t program)
+{
+    delete reinterpret_cast<HostProgram*>(program.handle);
+    return HSA_STATUS_SUCCESS;
+}
+
+static hsa_status_t HostProgramAddModule(hsa_ext_program_t program, hsa_ext_module_t module)
+{
+    if (nullptr == module)
+    {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+
+    reinterpret_cast<HostProgram*>(program.handle)->m_modules.push_back(module);
+    return HSA_STATUS_SUCCESS;
+}
+
+static hsa_status_t HostProgramIterateModules(hsa_ext_program_t program,
+                                              hsa_status_t (*callback)(hsa_ext_program_t, hsa_ext_module_t, void*),
+                                              void* pData)
+{
+    const std::vector<hsa_ext_module_t>& modules = reinterpret_cast<HostProgram*>(program.handle)->m_modules;
+
+    for (std::size_t i = 0; i < modules.size(); ++i)
+    {
+        hsa_status_t status = callback(program, modules[i], pData);
+
+        if (HSA_STATUS_SUCCESS != status)
+        {
+            return (HSA_STATUS_INFO_BREAK == status) ? HSA_STATUS_SUCCESS : status;
+        }
+    }
+
+    return HSA_STATUS_SUCCESS;
+}
+
+static hsa_status_t HostProgramGetInfo(hsa_ext_program_t program, hsa_ext_program_info_t attribute, void* pValue)
+{
+    const HostProgram* pHostProgram = reinterpret_cast<HostProgram*>(program.handle);
+
+    switch (attribute)
+    {
+        case HSA_EXT_PROGRAM_INFO_MACHINE_MODEL:
+            *reinterpret_cast<hsa_machine_model_t*>(pValue) = pHostProgram->m_machineModel;
+            return HSA_STATUS_SUCCESS;
+
+        case HSA_EXT_PROGRAM_INFO_PROFILE:
+            *reinterpret_cast<hsa_profile_t*>(pValue) = pHostProgram->m_profile;
+            return HSA_STATUS_SUCCESS;
+
+        case HSA_EXT_PROGRAM_INFO_DEFAULT_FLOAT_ROUNDING_MODE:
+            *reinterpret_cast<hsa_default_float_rounding_mode_t*>(pValue) = pHostProgram->m_roundingMode;
+            return HSA_STATUS_SUCCESS;
+
+        default:
+            return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+}
+
+static hsa_status_t HostProgramFinalize(hsa_ext_program_t            program,
+                                        hsa_isa_t                    isa,
+                                        int32_t                      callConvention,
+                                        hsa_ext_control_directives_t controlDirectives,
+                                        const char*                  pOptions,
+                                        hsa_code_object_type_t       codeObjectType,
+                                        hsa_code_object_t*           pCodeObject)
+{
+    (void)callConvention;
+    (void)controlDirectives;
+    (void)pOptions;
+    (void)codeObjectType;
+
+    const HostProgram* pHostProgram = reinterpret_cast<HostProgram*>(program.handle);
+
+    if (gs_ISA != isa.handle || nullptr == pCodeObject || pHostProgram->m_modules.empty())
+    {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+
+    std::string kernels;
+
+    for (std::size_t i = 0; i < pHostProgram->m_modules.size(); ++i)
+    {
+        kernels += reinterpret_cast<const char*>(pHostProgram->m_modules[i]);
+        kernels += "\n";
+    }
+
+    std::deque<HostSymbol> symbols;
+
+    if (!ParseKernels(kernels, symbols))
+    {
+        return HSA_STATUS_ERROR;
+    }
+
+    HostCodeObject* pHostCodeObject = new HostCodeObject;
+    pHostCodeObject->m_kernels = kernels;
+    pCodeObject->handle = reinterpret_cast<uint64_t>(pHostCodeObject);
+    return HSA_STATUS_SUCCESS;
+}
+
+} // namespace AMDT
+
+// ------------------ HSA runtime functions ------------------------
+
+using namespace AMDT;
+
+extern "C" {
+
+hsa_status_t hsa_init()
+{
+    ++gs_initCount;
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_shut_down()
+{
+    if (0 >= gs_initCount.load())
+    {
+        return HSA_STATUS_ERROR_NOT_INITIALIZED;
+    }
+
+    --gs_initCount;
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_status_string(hsa_status_t status, const char** pStatusString)
+{
+    if (nullptr == pStatusString)
+    {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+
+    switch (status)
+    {
+        case HSA_STATUS_SUCCESS:
+            *pStatusString = "HSA_STATUS_SUCCESS: The function has been executed successfully.";
+            break;
+
+        case HSA_STATUS_ERROR_INVALID_ARGUMENT:
+            *pStatusString = "HSA_STATUS_ERROR_INVALID_ARGUMENT: One of the actual arguments does not meet a precondition.";
+            break;
+
+        case HSA_STATUS_ERROR_NOT_INITIALIZED:
+            *pStatusString = "HSA_STATUS_ERROR_NOT_INITIALIZED: The HSA runtime is not initialized.";
+            break;
+
+        case HSA_STATUS_ERROR_OUT_OF_RESOURCES:
+            *pStatusString = "HSA_STATUS_ERROR_OUT_OF_RESOURCES: The runtime failed to allocate the necessary resources.";
+            break;
+
+        default:
+            *pStatusString = "HSA_STATUS_ERROR: A generic error has occurred.";
+            break;
+    }
+
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_system_get_info(hsa_system_info_t attribute, void* pValue)
+{
+    switch (attribute)
+    {
+        case HSA_SYSTEM_INFO_VERSION_MAJOR:
+        case HSA_SYSTEM_INFO_VERSION_MINOR:
+            *reinterpret_cast<uint16_t*>(pValue) = 1;
+            return HSA_STATUS_SUCCESS;
+
+        case HSA_SYSTEM_INFO_TIMESTAMP:
+            *reinterpret_cast<uint64_t*>(pValue) = HostTicks();
+            return HSA_STATUS_SUCCESS;
+
+        case HSA_SYSTEM_INFO_TIMESTAMP_FREQUENCY:
+            *reinterpret_cast<uint64_t*>(pValue) = gs_TIMESTAMP_FREQUENCY;
+            return HSA_STATUS_SUCCESS;
+
+        default:
+            return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+}
+
+hsa_status_t hsa_system_extension_supported(uint16_t extension, uint16_t versionMajor, uint16_t versionMinor, bool* pResult)
+{
+    (void)versionMinor;
+
+    if (0 >= gs_initCount.load())
+    {
+        return HSA_STATUS_ERROR_NOT_INITIALIZED;
+    }
+
+    *pResult = (HSA_EXTENSION_FINALIZER == extension && 1 == versionMajor);
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_system_get_extension_table(uint16_t extension, uint16_t versionMajor, uint16_t versionMinor, void* pTable)
+{
+    (void)versionMinor;
+
+    if (HSA_EXTENSION_FINALIZER != extension || 1 != versionMajor || nullptr == pTable)
+    {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+
+    hsa_ext_finalizer_1_00_pfn_t* pFinalizer = reinterpret_cast<hsa_ext_finalizer_1_00_pfn_t*>(pTable);
+    pFinalizer->hsa_ext_program_create = HostProgramCreate;
+    pFinalizer->hsa_ext_program_destroy = HostProgramDestroy;
+    pFinalizer->hsa_ext_program_add_module = HostProgramAddModule;
+    pFinalizer->hsa_ext_program_iterate_modules = HostProgramIterateModules;
+    pFinalizer->hsa_ext_program_get_info = HostProgramGetInfo;
+    pFinalizer->hsa_ext_program_finalize = HostProgramFinalize;
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_iterate_agents(hsa_status_t (*callback)(hsa_agent_t agent, void* pData), void* pData)
+{
+    const hsa_agent_t agents[] = { { gs_GPU_AGENT }, { gs_CPU_AGENT } };
+
+    for (std::size_t i = 0; i < sizeof(agents) / sizeof(agents[0]); ++i)
+    {
+        hsa_status_t status = callback(agents[i], pData);
+
+        if (HSA_STATUS_SUCCESS != status)
+        {
+            return (HSA_STATUS_INFO_BREAK == status) ? HSA_STATUS_SUCCESS : status;
+        }
+    }
+
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_agent_get_info(hsa_agent_t agent, hsa_agent_info_t attribute, void* pValue)
+{
+    const bool isGpu = (gs_GPU_AGENT == agent.handle);
+
+    if (!isGpu && gs_CPU_AGENT != agent.handle)
+    {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+
+    if (HSA_AMD_AGENT_INFO_CHIP_ID == static_cast<int>(attribute))
+    {
+        *reinterpret_cast<uint32_t*>(pValue) = 0;
+        return HSA_STATUS_SUCCESS;
+    }
+
+    switch (attribute)
+    {
+        case HSA_AGENT_INFO_NAME:
+            memset(pValue, 0, 64);
+            strncpy(reinterpret_cast<char*>(pValue), isGpu ? "Host stand-in GPU" : "Host stand-in CPU", 63);
+            return HSA_STATUS_SUCCESS;
+
+        case HSA_AGENT_INFO_DEVICE:
+            *reinterpret_cast<hsa_device_type_t*>(pValue) = isGpu ? HSA_DEVICE_TYPE_GPU : HSA_DEVICE_TYPE_CPU;
+            return HSA_STATUS_SUCCESS;
+
+        case HSA_AGENT_INFO_PROFILE:
+            *reinterpret_cast<hsa_profile_t*>(pValue) = HSA_PROFILE_FULL;
+            return HSA_STATUS_SUCCESS;
+
+        case HSA_AGENT_INFO_QUEUE_MAX_SIZE:
+            *reinterpret_cast<uint32_t*>(pValue) = isGpu ? gs_HOST_QUEUE_SIZE : 0;
+            return HSA_STATUS_SUCCESS;
+
+        case HSA_AGENT_INFO_NODE:
+            *reinterpret_cast<uint32_t*>(pValue) = isGpu ? 1 : 0;
+            return HSA_STATUS_SUCCESS;
+
+        case HSA_AGENT_INFO_ISA:
+            reinterpret_cast<hsa_isa_t*>(pValue)->handle = isGpu ? gs_ISA : 0;
+            return HSA_STATUS_SUCCESS;
+
+        default:
+            return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+}
+
+hsa_status_t hsa_agent_iterate_regions(hsa_agent_t agent, hsa_status_t (*callback)(hsa_region_t region, void* pData), void* pData)
+{
+    std::vector<hsa_region_t> regions;
+
+    if (gs_GPU_AGENT == agent.handle)
+    {
+        hsa_region_t coarseRegion = { gs_GPU_COARSE_REGION };
+        hsa_region_t kernargRegion = { gs_GPU_KERNARG_REGION };
+        regions.push_back(coarseRegion);
+        regions.push_back(kernargRegion);
+    }
+    else if (gs_CPU_AGENT == agent.handle)
+    {
+        hsa_region_t systemRegion = { gs_CPU_SYSTEM_REGION };
+        regions.push_back(systemRegion);
+    }
+    else
+    {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+
+    for (std::size_t i = 0; i < regions.size(); ++i)
+    {
+        hsa_status_t status = callback(regions[i], pData);
+
+        if (HSA_STATUS_SUCCESS != status)
+        {
+            return (HSA_STATUS_INFO_BREAK == status) ? HSA_STATUS_SUCCESS : status;
+        }
+    }
+
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_region_get_info(hsa_region_t region, hsa_region_info_t attribute, void* pValue)
+{
+    switch (attribute)
+    {
+        case HSA_REGION_INFO_SEGMENT:
+            *reinterpret_cast<hsa_region_segment_t*>(pValue) = HSA_REGION_SEGMENT_GLOBAL;
+            return HSA_STATUS_SUCCESS;
+
+        case HSA_REGION_INFO_GLOBAL_FLAGS:
+            *reinterpret_cast<uint32_t*>(pValue) = (gs_GPU_COARSE_REGION == region.handle) ?
+                                                   HSA_REGION_GLOBAL_FLAG_COARSE_GRAINED :
+                                                   (HSA_REGION_GLOBAL_FLAG_KERNARG | HSA_REGION_GLOBAL_FLAG_FINE_GRAINED);
+            return HSA_STATUS_SUCCESS;
+
+        default:
+            return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+}
+
+hsa_status_t hsa_memory_allocate(hsa_region_t region, size_t size, void** ppPtr)
+{
+    if (0 == region.handle || gs_CPU_SYSTEM_REGION < region.handle || 0 == size || nullptr == ppPtr)
+    {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+
+    return (0 == posix_memalign(ppPtr, gs_ALLOCATION_ALIGNMENT, size)) ? HSA_STATUS_SUCCESS : HSA_STATUS_ERROR_OUT_OF_RESOURCES;
+}
+
+hsa_status_t hsa_memory_free(void* pPtr)
+{
+    free(pPtr);
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_memory_copy(void* pDst, const void* pSrc, size_t size)
+{
+    if (nullptr == pDst || nullptr == pSrc)
+    {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+
+    memcpy(pDst, pSrc, size);
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_memory_assign_agent(void* pPtr, hsa_agent_t agent, hsa_access_permission_t access)
+{
+    (void)access;
+    return (nullptr == pPtr || (gs_GPU_AGENT != agent.handle && gs_CPU_AGENT != agent.handle)) ?
+           HSA_STATUS_ERROR_INVALID_ARGUMENT : HSA_STATUS_SUCCESS;
+}
+
+// ------------------ Signals ------------------------
+
+hsa_status_t hsa_signal_create(hsa_signal_value_t initialValue, uint32_t numConsumers, const hsa_agent_t* pConsumers, hsa_signal_t* pSignal)
+{
+    (void)numConsumers;
+    (void)pConsumers;
+
+    if (nullptr == pSignal)
+    {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+
+    pSignal->handle = reinterpret_cast<uint64_t>(new HostSignal(initialValue));
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_signal_destroy(hsa_signal_t signal)
+{
+    if (0 == signal.handle)
+    {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(gs_dispatchTimesMutex);
+        gs_dispatchTimes.erase(signal.handle);
+    }
+
+    {
+        // Wait for a change of the value still in progress
+        std::lock_guard<std::mutex> lock(ToHostSignal(signal)->m_handlersMutex);
+    }
+
+    delete ToHostSignal(signal);
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_signal_value_t hsa_signal_load_relaxed(hsa_signal_t signal)
+{
+    return ToHostSignal(signal)->m_value.load(std::memory_order_relaxed);
+}
+
+hsa_signal_value_t hsa_signal_load_acquire(hsa_signal_t signal)
+{
+    return ToHostSignal(signal)->m_value.load(std::memory_order_acquire);
+}
+
+void hsa_signal_store_relaxed(hsa_signal_t signal, hsa_signal_value_t value)
+{
+    ChangeSignal(signal, value, false, std::memory_order_relaxed);
+}
+
+void hsa_signal_store_release(hsa_signal_t signal, hsa_signal_value_t value)
+{
+    ChangeSignal(signal, value, false, std::memory_order_release);
+}
+
+void hsa_signal_add_relaxed(hsa_signal_t signal, hsa_signal_value_t value)
+{
+    ChangeSignal(signal, value, true, std::memory_order_relaxed);
+}
+
+void hsa_signal_subtract_relaxed(hsa_signal_t signal, hsa_signal_value_t value)
+{
+    ChangeSignal(signal, -value, true, std::memory_order_relaxed);
+}
+
+hsa_signal_value_t hsa_signal_wait_acquire(hsa_signal_t signal, hsa_signal_condition_t condition, hsa_signal_value_t compareValue,
+                                           uint64_t timeoutHint, hsa_wait_state_t waitStateHint)
+{
+    (void)waitStateHint;
+    return WaitSignal(signal, condition, compareValue, timeoutHint, std::memory_order_acquire);
+}
+
+hsa_signal_value_t hsa_signal_wait_relaxed(hsa_signal_t signal, hsa_signal_condition_t condition, hsa_signal_value_t compareValue,
+                                           uint64_t timeoutHint, hsa_wait_state_t waitStateHint)
+{
+    (void)waitStateHint;
+    return WaitSignal(signal, condition, compareValue, timeoutHint, std::memory_order_relaxed);
+}
+
+hsa_status_t hsa_amd_signal_async_handler(hsa_signal_t signal, hsa_signal_condition_t condition, hsa_signal_value_t value,
+                                          hsa_amd_signal_handler handler, void* pArg)
+{
+    if (0 == signal.handle || nullptr == handler)
+    {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+
+    HostSignalHandler signalHandler;
+    signalHandler.m_condition = condition;
+    signalHandler.m_compareValue = value;
+    signalHandler.m_handler = handler;
+    signalHandler.m_pArg = pArg;
+
+    HostSignal* pSignal = ToHostSignal(signal);
+
+    {
+        std::lock_guard<std::mutex> lock(pSignal->m_handlersMutex);
+        pSignal->m_handlers.push_back(signalHandler);
+    }
+
+    // The condition may already hold
+    ChangeSignal(signal, 0, true, std::memory_order_relaxed);
+    return HSA_STATUS_SUCCESS;
+}
+
+// ------------------ Queues ------------------------
+
+hsa_status_t hsa_queue_create(hsa_agent_t        agent,
+                              uint32_t           size,
+                              hsa_queue_type32_t type,
+                              void (*callback)(hsa_status_t status, hsa_queue_t* pSource, void* pData),
+                              void*              pData,
+                              uint32_t           privateSegmentSize,
+                              uint32_t           groupSegmentSize,
+                              hsa_queue_t**      ppQueue)
+{
+    (void)callback;
+    (void)pData;
+    (void)privateSegmentSize;
+    (void)groupSegmentSize;
+
+    if (gs_GPU_AGENT != agent.handle || 0 == size || 0 != (size & (size - 1)) || gs_HOST_QUEUE_SIZE < size || nullptr == ppQueue)
+    {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+
+    void* pSlots = nullptr;
+
+    if (0 != posix_memalign(&pSlots, gs_ALLOCATION_ALIGNMENT, size * sizeof(hsa_kernel_dispatch_packet_t)))
+    {
+        return HSA_STATUS_ERROR_OUT_OF_RESOURCES;
+    }
+
+    // Every slot starts with an invalid header
+    hsa_kernel_dispatch_packet_t* pPackets = reinterpret_cast<hsa_kernel_dispatch_packet_t*>(pSlots);
+    memset(pSlots, 0, size * sizeof(hsa_kernel_dispatch_packet_t));
+
+    for (uint32_t i = 0; i < size; ++i)
+    {
+        pPackets[i].header = HSA_PACKET_TYPE_INVALID << HSA_PACKET_HEADER_TYPE;
+    }
+
+    static std::atomic<uint64_t> s_queueCount(0);
+
+    HostQueue* pHostQueue = new HostQueue;
+    pHostQueue->m_queue.type = type;
+    pHostQueue->m_queue.base_address = pSlots;
+    pHostQueue->m_queue.size = size;
+    pHostQueue->m_queue.id = s_queueCount++;
+
+    // The doorbell holds the index of the last packet rung, none yet
+    hsa_signal_create(-1, 0, nullptr, &pHostQueue->m_queue.doorbell_signal);
+
+    pHostQueue->m_processor = std::thread(ProcessPackets, pHostQueue);
+
+    *ppQueue = &pHostQueue->m_queue;
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_queue_destroy(hsa_queue_t* pQueue)
+{
+    if (nullptr == pQueue)
+    {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+
+    HostQueue* pHostQueue = ToHostQueue(pQueue);
+    pHostQueue->m_isDestroyed.store(true, std::memory_order_release);
+    pHostQueue->m_processor.join();
+
+    hsa_signal_destroy(pQueue->doorbell_signal);
+    free(pQueue->base_address);
+    delete pHostQueue;
+    return HSA_STATUS_SUCCESS;
+}
+
+uint64_t hsa_queue_load_read_index_acquire(const hsa_queue_t* pQueue)
+{
+    return ToHostQueue(pQueue)->m_readIndex.load(std::memory_order_acquire);
+}
+
+uint64_t hsa_queue_load_read_index_relaxed(const hsa_queue_t* pQueue)
+{
+    return ToHostQueue(pQueue)->m_readIndex.load(std::memory_order_relaxed);
+}
+
+uint64_t hsa_queue_load_write_index_acquire(const hsa_queue_t* pQueue)
+{
+    return ToHostQueue(pQueue)->m_writeIndex.load(std::memory_order_acquire);
+}
+
+uint64_t hsa_queue_load_write_index_relaxed(const hsa_queue_t* pQueue)
+{
+    return ToHostQueue(pQueue)->m_writeIndex.load(std::memory_order_relaxed);
+}
+
+void hsa_queue_store_write_index_relaxed(const hsa_queue_t* pQueue, uint64_t value)
+{
+    ToHostQueue(pQueue)->m_writeIndex.store(value, std::memory_order_relaxed);
+}
+
+void hsa_queue_store_write_index_release(const hsa_queue_t* pQueue, uint64_t value)
+{
+    ToHostQueue(pQueue)->m_writeIndex.store(value, std::memory_order_release);
+}
+
+uint64_t hsa_queue_add_write_index_relaxed(const hsa_queue_t* pQueue, uint64_t value)
+{
+    return ToHostQueue(pQueue)->m_writeIndex.fetch_add(value, std::memory_order_relaxed);
+}
+
+uint64_t hsa_queue_add_write_index_acq_rel(const hsa_queue_t* pQueue, uint64_t value)
+{
+    return ToHostQueue(pQueue)->m_writeIndex.fetch_add(value, std::memory_order_acq_rel);
+}
+
+uint64_t hsa_queue_add_write_index_release(const hsa_queue_t* pQueue, uint64_t value)
+{
+    return ToHostQueue(pQueue)->m_writeIndex.fetch_add(value, std::memory_order_release);
+}
+
+uint64_t hsa_queue_cas_write_index_acq_rel(const hsa_queue_t* pQueue, uint64_t expected, uint64_t value)
+{
+    ToHostQueue(pQueue)->m_writeIndex.compare_exchange_strong(expected, value, std::memory_order_acq_rel);
+    return expected;
+}
+
+hsa_status_t hsa_amd_profiling_set_profiler_enabled(hsa_queue_t* pQueue, int enable)
+{
+    if (nullptr == pQueue)
+    {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+
+    ToHostQueue(pQueue)->m_isProfiling.store(0 != enable, std::memory_order_relaxed);
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_amd_profiling_get_dispatch_time(hsa_agent_t agent, hsa_signal_t signal, hsa_amd_profiling_dispatch_time_t* pTime)
+{
+    if (gs_GPU_AGENT != agent.handle || nullptr == pTime)
+    {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+
+    std::lock_guard<std::mutex> lock(gs_dispatchTimesMutex);
+    std::unordered_map<uint64_t, hsa_amd_profiling_dispatch_time_t>::const_iterator iter = gs_dispatchTimes.find(signal.handle);
+
+    if (gs_dispatchTimes.end() == iter)
+    {
+        return HSA_STATUS_ERROR;
+    }
+
+    *pTime = iter->second;
+    return HSA_STATUS_SUCCESS;
+}
+
+// ------------------ Code objects and executables ------------------------
+
+hsa_status_t hsa_code_object_serialize(hsa_code_object_t   codeObject,
+                                       hsa_status_t (*allocCallback)(size_t size, hsa_callback_data_t data, void** ppAddress),
+                                       hsa_callback_data_t callbackData,
+                                       const char*         pOptions,
+                                       void**              ppSerializedCodeObject,
+                                       size_t*             pSerializedCodeObjectSize)
+{
+    (void)pOptions;
+
+    if (0 == codeObject.handle || nullptr == allocCallback || nullptr == ppSerializedCodeObject || nullptr == pSerializedCodeObjectSize)
+    {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+
+    const std::string& kernels = reinterpret_cast<HostCodeObject*>(codeObject.handle)->m_kernels;
+    hsa_status_t status = allocCallback(kernels.size(), callbackData, ppSerializedCodeObject);
+
+    if (HSA_STATUS_SUCCESS != status || nullptr == *ppSerializedCodeObject)
+    {
+        return HSA_STATUS_ERROR_OUT_OF_RESOURCES;
+    }
+
+    memcpy(*ppSerializedCodeObject, kernels.data(), kernels.size());
+    *pSerializedCodeObjectSize = kernels.size();
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_code_object_deserialize(void* pSerializedCodeObject, size_t serializedCodeObjectSize, const char* pOptions, hsa_code_object_t* pCodeObject)
+{
+    (void)pOptions;
+
+    if (nullptr == pSerializedCodeObject || 0 == serializedCodeObjectSize || nullptr == pCodeObject)
+    {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+
+    std::string kernels(reinterpret_cast<const char*>(pSerializedCodeObject), serializedCodeObjectSize);
+    std::deque<HostSymbol> symbols;
+
+    if (!ParseKernels(kernels, symbols))
+    {
+        return HSA_STATUS_ERROR;
+    }
+
+    HostCodeObject* pHostCodeObject = new HostCodeObject;
+    pHostCodeObject->m_kernels = kernels;
+    pCodeObject->handle = reinterpret_cast<uint64_t>(pHostCodeObject);
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_code_object_destroy(hsa_code_object_t codeObject)
+{
+    if (0 == codeObject.handle)
+    {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+
+    delete reinterpret_cast<HostCodeObject*>(codeObject.handle);
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_executable_create(hsa_profile_t profile, hsa_executable_state_t executableState, const char* pOptions, hsa_executable_t* pExecutable)
+{
+    (void)executableState;
+    (void)pOptions;
+
+    if (nullptr == pExecutable)
+    {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+
+    HostExecutable* pHostExecutable = new HostExecutable;
+    pHostExecutable->m_profile = profile;
+    pHostExecutable->m_isFrozen = false;
+    pExecutable->handle = reinterpret_cast<uint64_t>(pHostExecutable);
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_executable_destroy(hsa_executable_t executable)
+{
+    if (0 == executable.handle)
+    {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+
+    delete reinterpret_cast<HostExecutable*>(executable.handle);
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_executable_load_code_object(hsa_executable_t executable, hsa_agent_t agent, hsa_code_object_t codeObject, const char* pOptions)
+{
+    (void)pOptions;
+
+    if (0 == executable.handle || gs_GPU_AGENT != agent.handle || 0 == codeObject.handle)
+    {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+
+    HostExecutable* pHostExecutable = reinterpret_cast<HostExecutable*>(executable.handle);
+
+    if (pHostExecutable->m_isFrozen)
+    {
+        return HSA_STATUS_ERROR;
+    }
+
+    return ParseKernels(reinterpret_cast<HostCodeObject*>(codeObject.handle)->m_kernels, pHostExecutable->m_symbols) ?
+           HSA_STATUS_SUCCESS : HSA_STATUS_ERROR;
+}
+
+hsa_status_t hsa_executable_freeze(hsa_executable_t executable, const char* pOptions)
+{
+    (void)pOptions;
+
+    if (0 == executable.handle)
+    {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+
+    reinterpret_cast<HostExecutable*>(executable.handle)->m_isFrozen = true;
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_executable_get_symbol(hsa_executable_t         executable,
+                                       const char*              pModuleName,
+                                       const char*              pSymbolName,
+                                       hsa_agent_t              agent,
+                                       int32_t                  callConvention,
+                                       hsa_executable_symbol_t* pSymbol)
+{
+    (void)pModuleName;
+    (void)callConvention;
+
+    if (0 == executable.handle || nullptr == pSymbolName || gs_GPU_AGENT != agent.handle || nullptr == pSymbol)
+    {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+
+    std::deque<HostSymbol>& symbols = reinterpret_cast<HostExecutable*>(executable.handle)->m_symbols;
+
+    for (std::deque<HostSymbol>::iterator iter = symbols.begin(); iter != symbols.end(); ++iter)
+    {
+        if (iter->m_name == pSymbolName)
+        {
+            pSymbol->handle = reinterpret_cast<uint64_t>(&*iter);
+            return HSA_STATUS_SUCCESS;
+        }
+    }
+
+    return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+}
+
+hsa_status_t hsa_executable_symbol_get_info(hsa_executable_symbol_t symbol, hsa_executable_symbol_info_t attribute, void* pValue)
+{
+    if (0 == symbol.handle)
+    {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+
+    const HostSymbol* pHostSymbol = reinterpret_cast<const HostSymbol*>(symbol.handle);
+
+    switch (attribute)
+    {
+        case HSA_EXECUTABLE_SYMBOL_INFO_KERNEL_OBJECT:
+            // No code to run, the kernel object only has to be unique
+            *reinterpret_cast<uint64_t*>(pValue) = symbol.handle;
+            return HSA_STATUS_SUCCESS;
+
+        case HSA_EXECUTABLE_SYMBOL_INFO_KERNEL_KERNARG_SEGMENT_SIZE:
+            *reinterpret_cast<uint32_t*>(pValue) = pHostSymbol->m_kernargSize;
+            return HSA_STATUS_SUCCESS;
+
+        case HSA_EXECUTABLE_SYMBOL_INFO_KERNEL_GROUP_SEGMENT_SIZE:
+        case HSA_EXECUTABLE_SYMBOL_INFO_KERNEL_PRIVATE_SEGMENT_SIZE:
+            *reinterpret_cast<uint32_t*>(pValue) = 0;
+            return HSA_STATUS_SUCCESS;
+
+        default:
+            return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+}
+
+} // extern "C"
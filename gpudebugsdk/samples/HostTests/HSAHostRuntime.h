@@ -0,0 +1,52 @@
+//==============================================================================
+// Copyright (c) 2017 Advanced Micro Devices, Inc. All rights reserved.
+//
+/// \author AMD Developer Tools
+/// \file
+/// \brief  CPU-side stand-in for the part of the HSA runtime used by the
+///         samples, so that HSAResourceManager, HSADispatchCapture and the
+///         replay can be run and tested on a host without a GPU.
+///
+///         The stand-in has one GPU and one CPU agent, all the memory is host
+///         memory, and every queue has a packet processor thread which consumes
+///         the AQL packets as a GPU would, without running the kernels.
+///         A BRIG module is stood in for by a NUL terminated string
+///         "<kernel symbol> <kernarg segment size>", which the finalizer turns
+///         into a code object holding the same string.
+//==============================================================================
+#ifndef HSA_HOST_RUNTIME_H_
+#define HSA_HOST_RUNTIME_H_
+
+#include <cstdint>
+
+#include <hsa.h>
+
+namespace AMDT
+{
+
+/// Size of the queues of the stand-in GPU, small so that the queues are often full
+static const uint32_t gs_HOST_QUEUE_SIZE = 64;
+
+/// \brief Called by the packet processor of a queue for every packet it consumes, before the slot is released.
+///
+/// \param[in] pQueue   The queue of the packet
+/// \param[in] packetId The index of the packet in the queue
+/// \param[in] packet   Copy of the packet, taken once its header was valid
+/// \param[in] pSlot    The slot of the packet in the queue, which must still hold the same packet
+/// \param[in] pData    The data given to SetHostPacketCallback()
+typedef void (*HostPacketCallback)(const hsa_queue_t*                  pQueue,
+                                   uint64_t                            packetId,
+                                   const hsa_kernel_dispatch_packet_t& packet,
+                                   const hsa_kernel_dispatch_packet_t* pSlot,
+                                   void*                               pData);
+
+/// \brief Set the function called for every packet consumed, nullptr for none.
+///        Must not be changed while a queue has packets to consume.
+///
+/// \param[in] callback The function to call
+/// \param[in] pData    Passed to the callback
+void SetHostPacketCallback(HostPacketCallback callback, void* pData);
+
+} // namespace AMDT
+
+#endif // HSA_HOST_RUNTIME_H_
@@ -0,0 +1,366 @@
+//==============================================================================
+// Copyright (c) 2017 Advanced Micro Devices, Inc. All rights reserved.
+//
+/// \author AMD Developer Tools
+/// \file
+/// \brief  Stress the AQL packet publication of HSAResourceManager::DispatchBatch()
+///         on the CPU-side stand-in runtime.  Several host threads dispatch
+///         batches larger than the queues while the packet processors stall
+///         from time to time, and every packet consumed is checked:
+///         its body must be the one written with its header, it must still
+///         be in its slot until the read index passes it, and every packet
+///         must be consumed exactly once.
+//==============================================================================
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <hsa.h>
+
+#include "HSAResourceManager.h"
+#include "HSAHostRuntime.h"
+
+/// Packets dispatched by every thread
+static const uint32_t gs_PACKETS_PER_THREAD = 20000;
+
+/// The packet processors stall on one packet out of gs_STALL_PERIOD, so that the queues fill up
+static const uint32_t gs_STALL_PERIOD = 97;
+
+/// Mixed into the packets, so that a body from another packet does not match its header
+static const uint64_t gs_PACKET_KEY = 0x9E3779B97F4A7C15ULL;
+
+/// \brief What the packet processors have seen, shared by all the queues
+typedef struct StressState
+{
+    std::vector<std::atomic<uint32_t> > m_consumeCounts;  ///< times every packet was consumed, by thread and sequence number
+    std::atomic<uint64_t>               m_consumedCount;  ///< packets consumed
+    std::atomic<uint64_t>               m_tornCount;      ///< packets whose body does not match their header
+    std::atomic<uint64_t>               m_overwriteCount; ///< slots overwritten before the read index passed them
+    std::atomic<uint64_t>               m_orderErrorCount;///< packets of a thread consumed out of order on a queue
+    std::atomic<uint64_t>               m_maxBacklog;     ///< largest distance between the write index and a packet consumed
+    std::mutex                          m_lastSeqMutex;   ///< protect m_lastSeq
+    std::vector<std::vector<int64_t> >  m_lastSeq;        ///< last sequence number of every thread, by queue id
+
+    explicit StressState(unsigned int threadCount) :
+        m_consumeCounts(threadCount * gs_PACKETS_PER_THREAD),
+        m_consumedCount(0),
+        m_tornCount(0),
+        m_overwriteCount(0),
+        m_orderErrorCount(0),
+        m_maxBacklog(0)
+    {}
+} StressState;
+
+// ================================= Functions declaration ============================================
+
+// With recycleThreads, thread 0 lives for the whole run while the other threads dispatch one after the other.
+bool RunStress(unsigned int threadCount, unsigned int queueCount, bool multiProducer, AMDT::QueueSelectionPolicy policy,
+               bool recycleThreads = false);
+
+// Thread function, dispatch gs_PACKETS_PER_THREAD packets in batches of 1 to 3 queue sizes.
+void DispatchThread(AMDT::HSAResourceManager* pMyHsa, unsigned int threadIndex, bool* pRetOut);
+
+// Packet processor callback, check every packet consumed.
+void CheckPacket(const hsa_queue_t* pQueue, uint64_t packetId, const hsa_kernel_dispatch_packet_t& packet,
+                 const hsa_kernel_dispatch_packet_t* pSlot, void* pData);
+
+// Helper function to print the result of a check.
+bool Check(bool condition, const std::string& description);
+
+// =====================================================================================================
+
+int main(int argc, char** argv)
+{
+    using namespace AMDT;
+
+    (void)argc;
+    (void)argv;
+
+    if (true != HSAResourceManager::InitRuntime(false))
+    {
+        std::cerr << "main(): HSA runtime initialization fail, exiting...\n";
+        return 1;
+    }
+
+    // Keep the runtime up between the runs
+    HSAResourceManager myHsa;
+    bool ret = true;
+
+    // A single producer, multi producer queues shared by all the threads, then a queue per thread,
+    // also when the threads come and go.
+    // Stop at the first failure, the queues of a broken dispatch can hang the next runs.
+    ret = ret && RunStress(1, 1, false, QUEUE_SELECTION_ROUND_ROBIN);
+    ret = ret && RunStress(8, 1, true, QUEUE_SELECTION_ROUND_ROBIN);
+    ret = ret && RunStress(8, 3, true, QUEUE_SELECTION_ROUND_ROBIN);
+    ret = ret && RunStress(8, 3, true, QUEUE_SELECTION_THREAD_AFFINITY);
+    ret = ret && RunStress(4, 4, false, QUEUE_SELECTION_THREAD_AFFINITY);
+    ret = ret && RunStress(5, 2, false, QUEUE_SELECTION_THREAD_AFFINITY, true);
+
+    HSAResourceManager::ShutDown();
+
+    std::cout << (ret ? "QueueStressTest passed.\n" : "QueueStressTest FAILED.\n");
+    return ret ? 0 : 1;
+}
+
+bool RunStress(unsigned int threadCount, unsigned int queueCount, bool multiProducer, AMDT::QueueSelectionPolicy policy,
+               bool recycleThreads)
+{
+    using namespace AMDT;
+
+    std::cout << threadCount << " threads, " << queueCount << (multiProducer ? " multi" : " single") << " producer queues, "
+              << ((QUEUE_SELECTION_THREAD_AFFINITY == policy) ? "affinity" : "round robin")
+              << (recycleThreads ? ", recycled threads" : "") << "\n";
+
+    if (!HSAResourceManager::CreateDeviceQueues(HSAResourceManager::DefaultGPUIndex(), queueCount, multiProducer))
+    {
+        std::cerr << "Error in RunStress(): CreateDeviceQueues() failed.\n";
+        return false;
+    }
+
+    StressState state(threadCount);
+    SetHostPacketCallback(CheckPacket, &state);
+
+    // A resource manager per thread, created here since the resource managers are counted without a lock
+    std::vector<std::unique_ptr<HSAResourceManager> > resourceManagers;
+    std::vector<std::thread> threads;
+    std::unique_ptr<bool[]> threadRets(new bool[threadCount]);
+
+    for (unsigned int i = 0; i < threadCount; ++i)
+    {
+        resourceManagers.push_back(std::unique_ptr<HSAResourceManager>(new HSAResourceManager()));
+        resourceManagers.back()->SetQueueSelectionPolicy(policy);
+        threadRets[i] = false;
+    }
+
+    if (!recycleThreads)
+    {
+        for (unsigned int i = 0; i < threadCount; ++i)
+        {
+            threads.push_back(std::thread(DispatchThread, resourceManagers[i].get(), i, &threadRets[i]));
+        }
+
+        for (unsigned int i = 0; i < threadCount; ++i)
+        {
+            threads[i].join();
+        }
+    }
+    else
+    {
+        // Thread 0 keeps its queue until all the other threads are done
+        std::atomic<bool> isDone(false);
+        threads.push_back(std::thread([&]()
+        {
+            DispatchThread(resourceManagers[0].get(), 0, &threadRets[0]);
+
+            while (!isDone.load())
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }));
+
+        // Once a packet of thread 0 is consumed, its queue is selected
+        for (unsigned int i = 0; i < 10000 && 0 == state.m_consumedCount.load(); ++i)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        for (unsigned int i = 1; i < threadCount; ++i)
+        {
+            std::thread thread(DispatchThread, resourceManagers[i].get(), i, &threadRets[i]);
+            thread.join();
+        }
+
+        isDone.store(true);
+        threads[0].join();
+    }
+
+    bool ret = true;
+
+    for (unsigned int i = 0; i < threadCount; ++i)
+    {
+        ret &= threadRets[i];
+    }
+
+    ret = Check(ret, "dispatch from every thread");
+
+    // Let the packet processors drain the queues
+    const uint64_t packetCount = static_cast<uint64_t>(threadCount) * gs_PACKETS_PER_THREAD;
+
+    for (unsigned int i = 0; i < 10000 && state.m_consumedCount.load() < packetCount; ++i)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    HSAResourceManager::DestroyDeviceQueue(HSAResourceManager::DefaultGPUIndex());
+    SetHostPacketCallback(nullptr, nullptr);
+
+    uint64_t missingCount = 0;
+    uint64_t duplicateCount = 0;
+
+    for (std::size_t i = 0; i < state.m_consumeCounts.size(); ++i)
+    {
+        missingCount += (0 == state.m_consumeCounts[i]) ? 1 : 0;
+        duplicateCount += (1 < state.m_consumeCounts[i]) ? 1 : 0;
+    }
+
+    ret &= Check(0 == missingCount && packetCount == state.m_consumedCount.load(), "every packet consumed");
+    ret &= Check(0 == duplicateCount, "no packet consumed twice");
+    ret &= Check(0 == state.m_tornCount.load(), "no packet consumed with a partial body");
+    ret &= Check(0 == state.m_overwriteCount.load(), "no slot overwritten before the read index passed it");
+    ret &= Check(0 == state.m_orderErrorCount.load(), "packets of a thread consumed in order");
+    ret &= Check(AMDT::gs_HOST_QUEUE_SIZE < state.m_maxBacklog.load(), "producers waited on a full queue");
+
+    if (recycleThreads && !multiProducer)
+    {
+        // The threads started after thread 0 exited one by one, none of them may share its single producer queue
+        unsigned int sharedCount = 0;
+
+        for (std::size_t queue = 0; queue < state.m_lastSeq.size(); ++queue)
+        {
+            const std::vector<int64_t>& lastSeq = state.m_lastSeq[queue];
+
+            for (std::size_t i = 1; !lastSeq.empty() && 0 <= lastSeq[0] && i < lastSeq.size(); ++i)
+            {
+                sharedCount += (0 <= lastSeq[i]) ? 1 : 0;
+            }
+        }
+
+        ret &= Check(0 == sharedCount, "no thread shares the queue of a live thread");
+    }
+
+    return ret;
+}
+
+void DispatchThread(AMDT::HSAResourceManager* pMyHsa, unsigned int threadIndex, bool* pRetOut)
+{
+    using namespace AMDT;
+
+    // Fields derived from the thread and sequence number, checked by CheckPacket()
+    std::vector<hsa_kernel_dispatch_packet_t> packets(3 * gs_HOST_QUEUE_SIZE);
+    uint32_t seq = 0;
+    uint32_t batchSize = 1 + threadIndex;
+    bool ret = true;
+
+    while (ret && seq < gs_PACKETS_PER_THREAD)
+    {
+        batchSize = (batchSize * 13 + 7) % packets.size() + 1;
+
+        if (gs_PACKETS_PER_THREAD - seq < batchSize)
+        {
+            batchSize = gs_PACKETS_PER_THREAD - seq;
+        }
+
+        for (uint32_t i = 0; i < batchSize; ++i, ++seq)
+        {
+            hsa_kernel_dispatch_packet_t& packet = packets[i];
+            memset(&packet, 0, sizeof(packet));
+            packet.header = (HSA_PACKET_TYPE_KERNEL_DISPATCH << HSA_PACKET_HEADER_TYPE) |
+                            (HSA_FENCE_SCOPE_SYSTEM << HSA_PACKET_HEADER_ACQUIRE_FENCE_SCOPE) |
+                            (HSA_FENCE_SCOPE_SYSTEM << HSA_PACKET_HEADER_RELEASE_FENCE_SCOPE);
+            packet.setup = static_cast<uint16_t>(1 + seq % 3) << HSA_KERNEL_DISPATCH_PACKET_SETUP_DIMENSIONS;
+            packet.workgroup_size_x = static_cast<uint16_t>(seq);
+            packet.grid_size_x = threadIndex;
+            packet.grid_size_y = seq;
+            packet.grid_size_z = ~seq;
+            packet.kernel_object = ((static_cast<uint64_t>(threadIndex) << 32) | seq) ^ gs_PACKET_KEY;
+            packet.kernarg_address = reinterpret_cast<void*>(packet.kernel_object | 1);
+            packet.reserved2 = packet.kernel_object * 3;
+        }
+
+        ret = pMyHsa->DispatchBatch(packets.data(), batchSize);
+    }
+
+    *pRetOut = ret;
+}
+
+void CheckPacket(const hsa_queue_t* pQueue, uint64_t packetId, const hsa_kernel_dispatch_packet_t& packet,
+                 const hsa_kernel_dispatch_packet_t* pSlot, void* pData)
+{
+    StressState& state = *reinterpret_cast<StressState*>(pData);
+
+    const uint32_t threadIndex = packet.grid_size_x;
+    const uint32_t seq = packet.grid_size_y;
+    const uint64_t key = ((static_cast<uint64_t>(threadIndex) << 32) | seq) ^ gs_PACKET_KEY;
+
+    // The header and setup are published together after the body
+    bool isComplete = (HSA_PACKET_TYPE_KERNEL_DISPATCH == ((packet.header >> HSA_PACKET_HEADER_TYPE) & 0xFF)) &&
+                      (1 + seq % 3 == packet.setup) &&
+                      (static_cast<uint16_t>(seq) == packet.workgroup_size_x) &&
+                      (~seq == packet.grid_size_z) &&
+                      (key == packet.kernel_object) &&
+                      (reinterpret_cast<void*>(key | 1) == packet.kernarg_address) &&
+                      (key * 3 == packet.reserved2) &&
+                      (static_cast<std::size_t>(threadIndex) * gs_PACKETS_PER_THREAD + seq < state.m_consumeCounts.size());
+
+    if (!isComplete)
+    {
+        ++state.m_tornCount;
+        ++state.m_consumedCount;
+        return;
+    }
+
+    // A packet of a thread is behind the packets it dispatched earlier to the same queue
+    {
+        std::lock_guard<std::mutex> lock(state.m_lastSeqMutex);
+
+        if (state.m_lastSeq.size() <= pQueue->id)
+        {
+            state.m_lastSeq.resize(pQueue->id + 1);
+        }
+
+        std::vector<int64_t>& lastSeq = state.m_lastSeq[pQueue->id];
+
+        if (lastSeq.size() <= threadIndex)
+        {
+            lastSeq.resize(threadIndex + 1, -1);
+        }
+
+        if (static_cast<int64_t>(seq) <= lastSeq[threadIndex])
+        {
+            ++state.m_orderErrorCount;
+        }
+
+        lastSeq[threadIndex] = seq;
+    }
+
+    // Stall now and then, the producers keep reserving slots meanwhile
+    if (0 == packetId % gs_STALL_PERIOD)
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+
+    uint64_t backlog = hsa_queue_load_write_index_relaxed(pQueue) - packetId;
+    uint64_t maxBacklog = state.m_maxBacklog.load();
+
+    while (backlog > maxBacklog && !state.m_maxBacklog.compare_exchange_weak(maxBacklog, backlog))
+    {
+    }
+
+    // The slot is not released yet, nothing may have been written to it
+    if (0 != memcmp(reinterpret_cast<const char*>(pSlot) + sizeof(uint32_t),
+                    reinterpret_cast<const char*>(&packet) + sizeof(uint32_t),
+                    sizeof(packet) - sizeof(uint32_t)))
+    {
+        ++state.m_overwriteCount;
+    }
+
+    ++state.m_consumeCounts[static_cast<std::size_t>(threadIndex) * gs_PACKETS_PER_THREAD + seq];
+    ++state.m_consumedCount;
+}
+
+bool Check(bool condition, const std::string& description)
+{
+    if (!condition)
+    {
+        std::cout << "FAILED: " << description << "\n";
+    }
+
+    return condition;
+}
@@ -15,23 +15,41 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #endif
+#include <chrono>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <time.h>
 #include <vector>
 
 #include <hsa.h>
 
 #include "HSAResourceManager.h"
+#include "HSADispatchCapture.h"
+#include "DispatchTraceReader.h"
 
 static const std::string gs_MATRIX_MUL_KERNEL_SYMBOL = "&__OpenCL_matrixMul_kernel";
 static const std::string gs_MATRIX_MUL_KERNEL_BRIG_FILE = "matrixMul_kernel.brig";
 
 static const std::string gs_OUTPUT_MATRIX_DIR = "./outputMatrix/";
 
+/// Number of dispatches kept in flight by the dispatch benchmark
+static const unsigned int gs_BENCHMARK_WINDOW = 64;
+
 // ================================= Functions declaration ============================================
 
-void RunTest(bool doVerify);
+void RunTest(bool doVerify, unsigned int benchmarkCount, unsigned int multiGpuCount,
+             const std::string& captureFile, const std::string& traceFile);
+
+// Helper function to re-dispatch the kernel, gs_BENCHMARK_WINDOW dispatches in flight, and report the dispatch throughput.
+void RunDispatchBenchmark(AMDT::HSAResourceManager& myHsa, hsa_kernel_dispatch_packet_t& aql, unsigned int benchmarkCount);
+
+// Helper function to split the matrix multiplication across 1 to all GPUs and report the scaling.
+void RunMultiGpuScaling(const std::vector<char>& brigData, float* pBufferA, float* pBufferB, float* pBufferC,
+                        size_t HA, size_t WA, size_t WB, size_t workGroupSize, unsigned int iterationCount);
+
+// Helper function to write the dispatch timing records as a dispatch trace and check that it reads back.
+bool WriteDispatchTrace(const std::string& fileName, const std::vector<AMDT::DispatchTiming>& timings);
 
 // Helper function to load binary file into data.
 bool LoadFile(const std::string& fileName, std::vector<char>& data);
@@ -44,29 +62,60 @@ void OutputMatrix(const std::string& fileName, const float* pMatrix, const size_
 int main(int argc, char** argv)
 {
     bool doVerify = false;
+    unsigned int benchmarkCount = 0;
+    unsigned int multiGpuCount = 0;
+    std::string captureFile;
+    std::string traceFile;
 
-    if (argc > 1)
+    for (int i = 1; i < argc; ++i)
     {
-        std::string ipOption(argv[1]);
+        std::string ipOption(argv[i]);
 
         if (ipOption == "--verify")
         {
             doVerify = true;
         }
+        else if (ipOption == "--softcp" || ipOption == "--hwqueue")
+        {
+            // Needs to be done before the HSA runtime is initialized
+            AMDT::SetSoftCPMode(ipOption == "--softcp");
+        }
+        else if (ipOption == "--benchmark" && i + 1 < argc)
+        {
+            benchmarkCount = static_cast<unsigned int>(strtoul(argv[++i], nullptr, 10));
+        }
+        else if (ipOption == "--multigpu" && i + 1 < argc)
+        {
+            multiGpuCount = static_cast<unsigned int>(strtoul(argv[++i], nullptr, 10));
+        }
+        else if (ipOption == "--capture" && i + 1 < argc)
+        {
+            captureFile = argv[++i];
+        }
+        else if (ipOption == "--trace" && i + 1 < argc)
+        {
+            traceFile = argv[++i];
+        }
         else
         {
             std::cout << "Matrixmul dispatches an HSAIL matrix multiplication kernel\n";
-            std::cout << "Possible options";
-            std::cout << " \t--verify\t verify correctness by comparing against a serial implementation\n";
+            std::cout << "Possible options\n";
+            std::cout << " \t--verify\t\t verify correctness by comparing against a serial implementation\n";
+            std::cout << " \t--benchmark <N>\t re-dispatch the kernel N times and report the dispatch throughput\n";
+            std::cout << " \t--multigpu <N>\t\t split the kernel across 1 to all GPUs, N times each, and report the scaling\n";
+            std::cout << " \t--capture <file>\t capture the kernel dispatch to a file, to be replayed by DispatchReplay\n";
+            std::cout << " \t--trace <file>\t\t write the kernel dispatch and its GPU timestamps to a dispatch trace file\n";
+            std::cout << " \t--softcp\t\t run all queues through software AQL emulation (SoftCP mode)\n";
+            std::cout << " \t--hwqueue\t\t run all queues on the hardware queues (SoftCP mode disabled)\n";
         }
-
     }
 
-    RunTest(doVerify);
+    RunTest(doVerify, benchmarkCount, multiGpuCount, captureFile, traceFile);
     return 0;
 }
 
-void RunTest(bool doVerify)
+void RunTest(bool doVerify, unsigned int benchmarkCount, unsigned int multiGpuCount,
+             const std::string& captureFile, const std::string& traceFile)
 {
     using namespace AMDT;
 
@@ -194,6 +243,25 @@ void RunTest(bool doVerify)
 
     myHsa.RegisterKernelArgsBuffer(aql);
 
+    // The capture file is written in the background while the kernel runs
+    HSADispatchCapture capture;
+
+    if (!captureFile.empty())
+    {
+        std::vector<DispatchCaptureBuffer> captureBuffers;
+        captureBuffers.push_back(DispatchCaptureBuffer(pBufferA, sizeA * sizeof(float)));
+        captureBuffers.push_back(DispatchCaptureBuffer(pBufferB, sizeB * sizeof(float)));
+        captureBuffers.push_back(DispatchCaptureBuffer(pBufferC, sizeC * sizeof(float)));
+
+        if (!capture.Open(captureFile) || !capture.CaptureDispatch(myHsa, aql, captureBuffers))
+        {
+            std::cerr << "RunTest(): Error on capturing the dispatch to \"" << captureFile << "\"\n";
+        }
+    }
+
+    // The timing record is filled in when the dispatch completes
+    myHsa.EnableDispatchTiming(!traceFile.empty());
+
     if (!myHsa.Dispatch(aql))
     {
         std::cerr << "RunTest(): Error on Dispatch()\n";
@@ -211,11 +279,40 @@ void RunTest(bool doVerify)
 
     std::cout << "Complete.\n";
 
+    if (!traceFile.empty())
+    {
+        myHsa.WaitForDispatchTimings();
+        myHsa.EnableDispatchTiming(false);
+
+        std::vector<DispatchTiming> timings;
+        myHsa.GetDispatchTimings(timings);
+
+        if (!WriteDispatchTrace(traceFile, timings))
+        {
+            std::cerr << "RunTest(): Error on writing the trace file \"" << traceFile << "\"\n";
+        }
+    }
+
+    if (!capture.Close())
+    {
+        std::cerr << "RunTest(): Error on writing the capture file \"" << captureFile << "\"\n";
+    }
+
 #ifdef _DEBUG
         // Output matrices data to files
         OutputMatrix("matrixC.mat", pBufferC, sizeC, WC);
 #endif
 
+    if (0 != benchmarkCount)
+    {
+        RunDispatchBenchmark(myHsa, aql, benchmarkCount);
+    }
+
+    if (0 != multiGpuCount)
+    {
+        RunMultiGpuScaling(brigData, pBufferA, pBufferB, pBufferC, HA, WA, WB, WORK_GROUP_SIZE, multiGpuCount);
+    }
+
     if (doVerify)
     {
         std::cout << "Calculating reference data...\n";
@@ -297,6 +394,264 @@ void RunTest(bool doVerify)
     HSAResourceManager::ShutDown();
 }
 
+void RunDispatchBenchmark(AMDT::HSAResourceManager& myHsa, hsa_kernel_dispatch_packet_t& aql, unsigned int benchmarkCount)
+{
+    const char* pEmulateAql = getenv("HSA_EMULATE_AQL");
+    bool isSoftCP = (nullptr != pEmulateAql && std::string(pEmulateAql) == "1");
+
+    std::cout << "Benchmarking " << benchmarkCount << " dispatches, " << gs_BENCHMARK_WINDOW << " in flight ("
+              << (isSoftCP ? "SoftCP mode" : "hardware queue") << ")...\n";
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    for (unsigned int i = 0; i < benchmarkCount; i += gs_BENCHMARK_WINDOW)
+    {
+        const unsigned int windowSize = (benchmarkCount - i < gs_BENCHMARK_WINDOW) ? benchmarkCount - i : gs_BENCHMARK_WINDOW;
+
+        // Every completed kernel decrements the signal, it reaches 0 once the whole window is done
+        hsa_signal_store_relaxed(aql.completion_signal, windowSize);
+
+        for (unsigned int j = 0; j < windowSize; ++j)
+        {
+            if (!myHsa.Dispatch(aql))
+            {
+                std::cerr << "RunDispatchBenchmark(): Error on Dispatch()\n";
+                return;
+            }
+        }
+
+        if (!myHsa.WaitForCompletion(aql.completion_signal))
+        {
+            std::cerr << "Error in RunDispatchBenchmark(): Signal return error.\n";
+            return;
+        }
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << "Dispatched " << benchmarkCount << " kernels in " << elapsed.count() * 1e3 << " milliseconds ("
+              << benchmarkCount / elapsed.count() << " dispatches per second).\n";
+}
+
+void RunMultiGpuScaling(const std::vector<char>& brigData, float* pBufferA, float* pBufferB, float* pBufferC,
+                        size_t HA, size_t WA, size_t WB, size_t workGroupSize, unsigned int iterationCount)
+{
+    using namespace AMDT;
+
+    // The rows of C are split across the GPUs in whole work-groups
+    const size_t rowGroupCount = HA / workGroupSize;
+    const size_t gpuCount = HSAResourceManager::GPUCount();
+    const size_t maxGpuCount = (gpuCount < rowGroupCount) ? gpuCount : rowGroupCount;
+
+    std::cout << "Splitting the kernel across 1 to " << maxGpuCount << " of " << gpuCount << " GPUs, "
+              << iterationCount << " dispatches each...\n";
+
+    // One resource manager per GPU, the kernel is finalized for each device
+    std::vector<std::unique_ptr<HSAResourceManager> > gpuHsa;
+    std::vector<hsa_kernel_dispatch_packet_t> finalizedAql(maxGpuCount);
+
+    for (unsigned int gpu = 0; gpu < maxGpuCount; ++gpu)
+    {
+        gpuHsa.push_back(std::unique_ptr<HSAResourceManager>(new HSAResourceManager(gpu)));
+
+        if (nullptr == HSAResourceManager::Queue(gpu) && !HSAResourceManager::CreateDeviceQueue(gpu))
+        {
+            std::cerr << "RunMultiGpuScaling(): Error on creating the queue of GPU " << gpu << ".\n";
+            return;
+        }
+
+        if (!gpuHsa[gpu]->CreateAQLPacketFromBrig(&brigData[0], gs_MATRIX_MUL_KERNEL_SYMBOL, false, finalizedAql[gpu]))
+        {
+            std::cerr << "RunMultiGpuScaling(): Error in finalizing the kernel for GPU " << gpu << ".\n";
+            return;
+        }
+    }
+
+    double singleGpuTime = 0.0;
+
+    for (size_t usedGpuCount = 1; usedGpuCount <= maxGpuCount; ++usedGpuCount)
+    {
+        std::vector<hsa_kernel_dispatch_packet_t> aql(usedGpuCount);
+        bool ret = true;
+
+        for (unsigned int gpu = 0; ret && gpu < usedGpuCount; ++gpu)
+        {
+            HSAResourceManager& myHsa = *gpuHsa[gpu];
+            const hsa_executable_t& executable = myHsa.GetAqlInfo(finalizedAql[gpu]).m_executable;
+
+            if (!myHsa.CreateAQLFromExecutable(executable, gs_MATRIX_MUL_KERNEL_SYMBOL, true, aql[gpu]))
+            {
+                std::cerr << "RunMultiGpuScaling(): Error in creating AQL packet for GPU " << gpu << ".\n";
+                ret = false;
+                break;
+            }
+
+            // Rows of C computed by this GPU
+            const size_t firstRow = rowGroupCount * gpu / usedGpuCount * workGroupSize;
+            const size_t endRow = rowGroupCount * (gpu + 1) / usedGpuCount * workGroupSize;
+            float* pBandC = pBufferC + firstRow * WB;
+            float* pBandA = pBufferA + firstRow * WA;
+
+            aql[gpu].setup |= 2 << HSA_KERNEL_DISPATCH_PACKET_SETUP_DIMENSIONS;
+            aql[gpu].workgroup_size_x = workGroupSize;
+            aql[gpu].workgroup_size_y = workGroupSize;
+            aql[gpu].grid_size_x = WB;
+            aql[gpu].grid_size_y = endRow - firstRow;
+
+            // The buffers are in system memory, which every GPU can access
+            ret = myHsa.AppendKernelArgs(&pBandC, sizeof(float*), aql[gpu]) &&
+                  myHsa.AppendKernelArgs(&pBandA, sizeof(float*), aql[gpu]) &&
+                  myHsa.AppendKernelArgs(&pBufferB, sizeof(float*), aql[gpu]) &&
+                  myHsa.AppendKernelArgs(&WA, sizeof(uint32_t), aql[gpu]) &&
+                  myHsa.AppendKernelArgs(&WB, sizeof(uint32_t), aql[gpu]) &&
+                  myHsa.RegisterKernelArgsBuffer(aql[gpu]);
+
+            if (!ret)
+            {
+                std::cerr << "RunMultiGpuScaling(): Error on AppendKernelArgs() for GPU " << gpu << ".\n";
+            }
+        }
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        for (unsigned int i = 0; ret && i < iterationCount; ++i)
+        {
+            // Launch on every GPU before waiting on any of them
+            for (unsigned int gpu = 0; ret && gpu < usedGpuCount; ++gpu)
+            {
+                hsa_signal_store_relaxed(aql[gpu].completion_signal, 1);
+                ret = gpuHsa[gpu]->Dispatch(aql[gpu]);
+            }
+
+            for (unsigned int gpu = 0; ret && gpu < usedGpuCount; ++gpu)
+            {
+                ret = gpuHsa[gpu]->WaitForCompletion(aql[gpu].completion_signal);
+            }
+        }
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        for (unsigned int gpu = 0; gpu < usedGpuCount; ++gpu)
+        {
+            gpuHsa[gpu]->DeregisterKernelArgsBuffer(aql[gpu]);
+            gpuHsa[gpu]->DestroySignal(aql[gpu].completion_signal);
+        }
+
+        if (!ret)
+        {
+            std::cerr << "Error in RunMultiGpuScaling(): Dispatch on " << usedGpuCount << " GPUs failed.\n";
+            return;
+        }
+
+        if (1 == usedGpuCount)
+        {
+            singleGpuTime = elapsed.count();
+        }
+
+        std::cout << usedGpuCount << " GPU(s): " << elapsed.count() * 1e3 / iterationCount << " milliseconds per dispatch, speedup "
+                  << singleGpuTime / elapsed.count() << "x\n";
+    }
+}
+
+bool WriteDispatchTrace(const std::string& fileName, const std::vector<AMDT::DispatchTiming>& timings)
+{
+    using namespace AMDT;
+
+    DispatchTraceWriter writer;
+    std::vector<DispatchTraceRecord> records(timings.size());
+    bool ret = writer.Open(fileName);
+
+    for (std::size_t i = 0; ret && i < timings.size(); ++i)
+    {
+        const DispatchTiming& timing = timings[i];
+        DispatchTraceRecord& record = records[i];
+
+        record.m_index = i;
+        record.m_queueId = timing.m_queueId;
+        record.m_packetId = timing.m_packetId;
+        record.m_device = timing.m_deviceIndex;
+        record.m_kernelName = timing.m_kernelSymbol;
+        record.m_header = timing.m_aql.header;
+        record.m_setup = timing.m_aql.setup;
+        record.m_workgroupSize[0] = timing.m_aql.workgroup_size_x;
+        record.m_workgroupSize[1] = timing.m_aql.workgroup_size_y;
+        record.m_workgroupSize[2] = timing.m_aql.workgroup_size_z;
+        record.m_gridSize[0] = timing.m_aql.grid_size_x;
+        record.m_gridSize[1] = timing.m_aql.grid_size_y;
+        record.m_gridSize[2] = timing.m_aql.grid_size_z;
+        record.m_privateSegmentSize = timing.m_aql.private_segment_size;
+        record.m_groupSegmentSize = timing.m_aql.group_segment_size;
+        record.m_kernelObject = timing.m_aql.kernel_object;
+        record.m_kernargAddress = reinterpret_cast<uint64_t>(timing.m_aql.kernarg_address);
+        record.m_completionSignal = timing.m_aql.completion_signal.handle;
+
+        // No GPU timestamps if kernel timestamps are not enabled on the queue
+        record.m_hasTiming = 0 != timing.m_gpuEnd;
+        record.m_gpuStart = timing.m_gpuStart;
+        record.m_gpuEnd = timing.m_gpuEnd;
+
+        // Host times are 0 if the system timestamp could not be read
+        record.m_hasHostTiming = 0 != timing.m_hostComplete;
+        record.m_hostEnqueue = timing.m_hostEnqueue;
+        record.m_hostComplete = timing.m_hostComplete;
+
+        ret = writer.WriteRecord(record);
+    }
+
+    ret = writer.Close() && ret;
+
+    if (!ret)
+    {
+        return false;
+    }
+
+    // Check that the trace tools read back what was written
+    DispatchTraceReader reader;
+
+    if (!reader.Open(fileName))
+    {
+        return false;
+    }
+
+    std::string chunk;
+    std::size_t rowCount = 0;
+    std::size_t badRows = 0;
+
+    while (reader.ReadChunk(chunk))
+    {
+        badRows += ForEachRecord(reader.Layout(), chunk, [&](const DispatchTraceRecord& readRecord)
+        {
+            if (rowCount >= records.size() ||
+                readRecord.m_queueId != records[rowCount].m_queueId ||
+                readRecord.m_packetId != records[rowCount].m_packetId ||
+                readRecord.m_device != records[rowCount].m_device ||
+                readRecord.m_kernelName != records[rowCount].m_kernelName ||
+                readRecord.m_gridSize[0] != records[rowCount].m_gridSize[0] ||
+                readRecord.m_hasTiming != records[rowCount].m_hasTiming ||
+                (readRecord.m_hasTiming && (readRecord.m_gpuStart != records[rowCount].m_gpuStart ||
+                                            readRecord.m_gpuEnd != records[rowCount].m_gpuEnd)) ||
+                readRecord.m_hasHostTiming != records[rowCount].m_hasHostTiming ||
+                (readRecord.m_hasHostTiming && (readRecord.m_hostEnqueue != records[rowCount].m_hostEnqueue ||
+                                                readRecord.m_hostComplete != records[rowCount].m_hostComplete)))
+            {
+                ++badRows;
+            }
+
+            ++rowCount;
+        });
+    }
+
+    if (0 != badRows || rowCount != records.size())
+    {
+        std::cerr << "Error in WriteDispatchTrace(): " << badRows << " of the " << rowCount << " rows read back from \""
+                  << fileName << "\" do not match the " << records.size() << " dispatches written.\n";
+        return false;
+    }
+
+    std::cout << "Wrote " << records.size() << " dispatch(es) to the trace \"" << fileName << "\".\n";
+    return true;
+}
+
 bool LoadFile(const std::string& fileName, std::vector<char>& data)
 {
     bool ret = false;
@@ -0,0 +1,614 @@
+//==============================================================================
+// Copyright (c) 2017 Advanced Micro Devices, Inc. All rights reserved.
+//
+/// \author AMD Developer Tools
+/// \file
+/// \brief  Streaming reader and writer for the GPU dispatch trace saved by "set rocm trace"
+//==============================================================================
+
+#include <cstdlib>   // strtoull
+#include <cstring>   // memset
+#include <iostream>
+
+#include "DispatchTraceReader.h"
+
+namespace AMDT
+{
+
+// Column names as written in the header row of the trace.
+// Needs to be kept in sync with DispatchTraceLayout::Column.
+static const char* gs_COLUMN_NAMES[] =
+{
+    "index",
+    "queue_id",
+    "packet_id",
+    "kernel_name",
+    "header",
+    "setup",
+    "workgroup_size",
+    "reserved0",
+    "grid_size",
+    "private_segment_size",
+    "group_segment_size",
+    "kernel_object",
+    "kernarg_address",
+    "reserved2",
+    "completion_signal",
+    "device",
+    "gpu_start_ns",
+    "gpu_end_ns",
+    "host_enqueue_ns",
+    "host_complete_ns"
+};
+
+// Number of columns written by "set rocm trace", in the order of DispatchTraceLayout::Column.
+static const std::size_t gs_DEFAULT_FIELD_COUNT = 15;
+
+// Simple function to trim head and tail space of a field.
+static void TrimField(const char*& pBegin, const char*& pEnd)
+{
+    while (pBegin < pEnd && (' ' == *pBegin || '\t' == *pBegin))
+    {
+        ++pBegin;
+    }
+
+    while (pEnd > pBegin && (' ' == *(pEnd - 1) || '\t' == *(pEnd - 1)))
+    {
+        --pEnd;
+    }
+}
+
+// Parse an unsigned decimal or 0x prefixed hexadecimal field.
+static bool ParseUnsigned(const char* pBegin, const char* pEnd, uint64_t& valueOut)
+{
+    TrimField(pBegin, pEnd);
+
+    if (pBegin == pEnd)
+    {
+        return false;
+    }
+
+    uint64_t value = 0;
+    unsigned int base = 10;
+
+    if (pEnd - pBegin > 2 && '0' == pBegin[0] && ('x' == pBegin[1] || 'X' == pBegin[1]))
+    {
+        base = 16;
+        pBegin += 2;
+    }
+
+    for (const char* p = pBegin; p < pEnd; ++p)
+    {
+        unsigned int digit = 0;
+
+        if (*p >= '0' && *p <= '9')
+        {
+            digit = *p - '0';
+        }
+        else if (16 == base && *p >= 'a' && *p <= 'f')
+        {
+            digit = *p - 'a' + 10;
+        }
+        else if (16 == base && *p >= 'A' && *p <= 'F')
+        {
+            digit = *p - 'A' + 10;
+        }
+        else
+        {
+            return false;
+        }
+
+        value = value * base + digit;
+    }
+
+    valueOut = value;
+    return true;
+}
+
+// Parse a "{x y z}" dimension field.
+static bool ParseDim3(const char* pBegin, const char* pEnd, uint32_t dimOut[3])
+{
+    TrimField(pBegin, pEnd);
+
+    if (pEnd - pBegin < 2 || '{' != *pBegin || '}' != *(pEnd - 1))
+    {
+        return false;
+    }
+
+    ++pBegin;
+    --pEnd;
+
+    for (int i = 0; i < 3; ++i)
+    {
+        while (pBegin < pEnd && ' ' == *pBegin)
+        {
+            ++pBegin;
+        }
+
+        const char* pValueEnd = pBegin;
+
+        while (pValueEnd < pEnd && ' ' != *pValueEnd)
+        {
+            ++pValueEnd;
+        }
+
+        uint64_t value = 0;
+
+        if (!ParseUnsigned(pBegin, pValueEnd, value))
+        {
+            return false;
+        }
+
+        dimOut[i] = static_cast<uint32_t>(value);
+        pBegin = pValueEnd;
+    }
+
+    return true;
+}
+
+// ------------------ Definitions of DispatchTraceRecord -----------------------
+
+DispatchTraceRecord::DispatchTraceRecord() :
+    m_index(0),
+    m_queueId(0),
+    m_packetId(0),
+    m_device(0),
+    m_header(0),
+    m_setup(0),
+    m_privateSegmentSize(0),
+    m_groupSegmentSize(0),
+    m_kernelObject(0),
+    m_kernargAddress(0),
+    m_completionSignal(0),
+    m_hasTiming(false),
+    m_gpuStart(0),
+    m_gpuEnd(0),
+    m_hasHostTiming(false),
+    m_hostEnqueue(0),
+    m_hostComplete(0)
+{
+    memset(m_workgroupSize, 0, sizeof(m_workgroupSize));
+    memset(m_gridSize, 0, sizeof(m_gridSize));
+}
+
+// ------------------ Definitions of DispatchTraceLayout -----------------------
+
+DispatchTraceLayout::DispatchTraceLayout() :
+    m_columnOf(COLUMN_COUNT, -1),
+    m_fieldCount(gs_DEFAULT_FIELD_COUNT)
+{
+    for (std::size_t i = 0; i < gs_DEFAULT_FIELD_COUNT; ++i)
+    {
+        m_columnOf[i] = static_cast<int>(i);
+    }
+}
+
+bool DispatchTraceLayout::ParseHeader(const std::string& headerLine)
+{
+    std::vector<int> columnOf(COLUMN_COUNT, -1);
+    std::size_t fieldCount = 0;
+    std::size_t fieldStart = 0;
+
+    while (fieldStart <= headerLine.size())
+    {
+        std::size_t fieldEnd = headerLine.find(',', fieldStart);
+
+        if (std::string::npos == fieldEnd)
+        {
+            fieldEnd = headerLine.size();
+        }
+
+        const char* pBegin = headerLine.data() + fieldStart;
+        const char* pEnd = headerLine.data() + fieldEnd;
+        TrimField(pBegin, pEnd);
+        std::string name(pBegin, pEnd);
+
+        for (int column = 0; column < COLUMN_COUNT; ++column)
+        {
+            if (name == gs_COLUMN_NAMES[column])
+            {
+                columnOf[column] = static_cast<int>(fieldCount);
+            }
+        }
+
+        ++fieldCount;
+        fieldStart = fieldEnd + 1;
+    }
+
+    // A data row starts with the numeric dispatch index
+    if (-1 == columnOf[COLUMN_KERNEL_NAME] || -1 == columnOf[COLUMN_INDEX])
+    {
+        return false;
+    }
+
+    m_columnOf = columnOf;
+    m_fieldCount = fieldCount;
+    return true;
+}
+
+bool DispatchTraceLayout::ParseRecord(const char* pBegin, const char* pEnd, DispatchTraceRecord& recordOut) const
+{
+    // Split the row into fields. Only the kernel name can contain commas,
+    // so any extra fields are folded back into it.
+    const std::size_t maxFields = 32;
+    const char* pFieldBegin[maxFields];
+    const char* pFieldEnd[maxFields];
+    std::size_t fieldCount = 0;
+    const char* pField = pBegin;
+
+    for (const char* p = pBegin; p <= pEnd; ++p)
+    {
+        if (p == pEnd || ',' == *p)
+        {
+            if (fieldCount == maxFields)
+            {
+                return false;
+            }
+
+            pFieldBegin[fieldCount] = pField;
+            pFieldEnd[fieldCount] = p;
+            ++fieldCount;
+            pField = p + 1;
+        }
+    }
+
+    if (fieldCount < m_fieldCount)
+    {
+        return false;
+    }
+
+    const std::size_t extraFields = fieldCount - m_fieldCount;
+    const int nameColumn = m_columnOf[COLUMN_KERNEL_NAME];
+
+    // Map a Column to the [begin, end) range of its field in this row
+    const char* pColumnBegin[COLUMN_COUNT];
+    const char* pColumnEnd[COLUMN_COUNT];
+
+    for (int column = 0; column < COLUMN_COUNT; ++column)
+    {
+        int position = m_columnOf[column];
+        pColumnBegin[column] = nullptr;
+        pColumnEnd[column] = nullptr;
+
+        if (-1 == position)
+        {
+            continue;
+        }
+
+        if (position == nameColumn)
+        {
+            pColumnBegin[column] = pFieldBegin[position];
+            pColumnEnd[column] = pFieldEnd[position + extraFields];
+        }
+        else
+        {
+            std::size_t field = (position > nameColumn) ? position + extraFields : position;
+            pColumnBegin[column] = pFieldBegin[field];
+            pColumnEnd[column] = pFieldEnd[field];
+        }
+    }
+
+    bool ret = true;
+    uint64_t value = 0;
+
+    ret &= ParseUnsigned(pColumnBegin[COLUMN_INDEX], pColumnEnd[COLUMN_INDEX], recordOut.m_index);
+
+    if (nullptr != pColumnBegin[COLUMN_QUEUE_ID])
+    {
+        ret &= ParseUnsigned(pColumnBegin[COLUMN_QUEUE_ID], pColumnEnd[COLUMN_QUEUE_ID], recordOut.m_queueId);
+    }
+
+    if (nullptr != pColumnBegin[COLUMN_PACKET_ID])
+    {
+        ret &= ParseUnsigned(pColumnBegin[COLUMN_PACKET_ID], pColumnEnd[COLUMN_PACKET_ID], recordOut.m_packetId);
+    }
+
+    recordOut.m_device = 0;
+
+    if (nullptr != pColumnBegin[COLUMN_DEVICE])
+    {
+        ret &= ParseUnsigned(pColumnBegin[COLUMN_DEVICE], pColumnEnd[COLUMN_DEVICE], recordOut.m_device);
+    }
+
+    {
+        const char* pNameBegin = pColumnBegin[COLUMN_KERNEL_NAME];
+        const char* pNameEnd = pColumnEnd[COLUMN_KERNEL_NAME];
+        TrimField(pNameBegin, pNameEnd);
+        recordOut.m_kernelName.assign(pNameBegin, pNameEnd);
+    }
+
+    if (nullptr != pColumnBegin[COLUMN_HEADER] && ParseUnsigned(pColumnBegin[COLUMN_HEADER], pColumnEnd[COLUMN_HEADER], value))
+    {
+        recordOut.m_header = static_cast<uint16_t>(value);
+    }
+
+    if (nullptr != pColumnBegin[COLUMN_SETUP] && ParseUnsigned(pColumnBegin[COLUMN_SETUP], pColumnEnd[COLUMN_SETUP], value))
+    {
+        recordOut.m_setup = static_cast<uint16_t>(value);
+    }
+
+    if (nullptr != pColumnBegin[COLUMN_WORKGROUP_SIZE])
+    {
+        ret &= ParseDim3(pColumnBegin[COLUMN_WORKGROUP_SIZE], pColumnEnd[COLUMN_WORKGROUP_SIZE], recordOut.m_workgroupSize);
+    }
+
+    if (nullptr != pColumnBegin[COLUMN_GRID_SIZE])
+    {
+        ret &= ParseDim3(pColumnBegin[COLUMN_GRID_SIZE], pColumnEnd[COLUMN_GRID_SIZE], recordOut.m_gridSize);
+    }
+
+    if (nullptr != pColumnBegin[COLUMN_PRIVATE_SEGMENT_SIZE] &&
+        ParseUnsigned(pColumnBegin[COLUMN_PRIVATE_SEGMENT_SIZE], pColumnEnd[COLUMN_PRIVATE_SEGMENT_SIZE], value))
+    {
+        recordOut.m_privateSegmentSize = static_cast<uint32_t>(value);
+    }
+
+    if (nullptr != pColumnBegin[COLUMN_GROUP_SEGMENT_SIZE] &&
+        ParseUnsigned(pColumnBegin[COLUMN_GROUP_SEGMENT_SIZE], pColumnEnd[COLUMN_GROUP_SEGMENT_SIZE], value))
+    {
+        recordOut.m_groupSegmentSize = static_cast<uint32_t>(value);
+    }
+
+    if (nullptr != pColumnBegin[COLUMN_KERNEL_OBJECT])
+    {
+        ParseUnsigned(pColumnBegin[COLUMN_KERNEL_OBJECT], pColumnEnd[COLUMN_KERNEL_OBJECT], recordOut.m_kernelObject);
+    }
+
+    if (nullptr != pColumnBegin[COLUMN_KERNARG_ADDRESS])
+    {
+        ParseUnsigned(pColumnBegin[COLUMN_KERNARG_ADDRESS], pColumnEnd[COLUMN_KERNARG_ADDRESS], recordOut.m_kernargAddress);
+    }
+
+    if (nullptr != pColumnBegin[COLUMN_COMPLETION_SIGNAL])
+    {
+        ParseUnsigned(pColumnBegin[COLUMN_COMPLETION_SIGNAL], pColumnEnd[COLUMN_COMPLETION_SIGNAL], recordOut.m_completionSignal);
+    }
+
+    // Timestamps are left empty when they were not collected for a dispatch
+    recordOut.m_hasTiming = HasTiming() &&
+                            ParseUnsigned(pColumnBegin[COLUMN_GPU_START], pColumnEnd[COLUMN_GPU_START], recordOut.m_gpuStart) &&
+                            ParseUnsigned(pColumnBegin[COLUMN_GPU_END], pColumnEnd[COLUMN_GPU_END], recordOut.m_gpuEnd) &&
+                            recordOut.m_gpuEnd >= recordOut.m_gpuStart;
+
+    recordOut.m_hasHostTiming = HasHostTiming() &&
+                                ParseUnsigned(pColumnBegin[COLUMN_HOST_ENQUEUE], pColumnEnd[COLUMN_HOST_ENQUEUE], recordOut.m_hostEnqueue) &&
+                                ParseUnsigned(pColumnBegin[COLUMN_HOST_COMPLETE], pColumnEnd[COLUMN_HOST_COMPLETE], recordOut.m_hostComplete) &&
+                                recordOut.m_hostComplete >= recordOut.m_hostEnqueue;
+
+    return ret;
+}
+
+bool DispatchTraceLayout::HasTiming() const
+{
+    return -1 != m_columnOf[COLUMN_GPU_START] && -1 != m_columnOf[COLUMN_GPU_END];
+}
+
+bool DispatchTraceLayout::HasHostTiming() const
+{
+    return -1 != m_columnOf[COLUMN_HOST_ENQUEUE] && -1 != m_columnOf[COLUMN_HOST_COMPLETE];
+}
+
+// ------------------ Definitions of DispatchTraceReader -----------------------
+
+DispatchTraceReader::DispatchTraceReader() :
+    m_failed(false)
+{
+}
+
+bool DispatchTraceReader::Open(const std::string& fileName)
+{
+    m_file.open(fileName, std::ios::binary);
+
+    if (!m_file.good())
+    {
+        std::cerr << "Error in DispatchTraceReader::Open(): Error when open file \"" << fileName << "\"\n";
+        return false;
+    }
+
+    std::string firstLine;
+
+    if (!std::getline(m_file, firstLine))
+    {
+        std::cerr << "Error in DispatchTraceReader::Open(): \"" << fileName << "\" is empty.\n";
+        return false;
+    }
+
+    if (!firstLine.empty() && '\r' == firstLine[firstLine.size() - 1])
+    {
+        firstLine.erase(firstLine.size() - 1);
+    }
+
+    // Traces without a header row use the default layout, keep the first row as data.
+    if (!m_layout.ParseHeader(firstLine))
+    {
+        m_carry = firstLine + "\n";
+    }
+
+    return true;
+}
+
+bool DispatchTraceReader::ReadChunk(std::string& chunkOut, std::size_t chunkSize)
+{
+    chunkOut.clear();
+
+    if (m_failed)
+    {
+        return false;
+    }
+
+    chunkOut.swap(m_carry);
+
+    // Read until the chunk ends with a complete row, or the end of the trace
+    while (m_file.good())
+    {
+        std::size_t carrySize = chunkOut.size();
+        chunkOut.resize(carrySize + chunkSize);
+        m_file.read(&chunkOut[carrySize], chunkSize);
+        chunkOut.resize(carrySize + static_cast<std::size_t>(m_file.gcount()));
+
+        if (!m_file.good())
+        {
+            break;
+        }
+
+        // Keep the trailing partial row for the next chunk
+        std::size_t lastNewLine = chunkOut.rfind('\n');
+
+        if (std::string::npos != lastNewLine)
+        {
+            m_carry.assign(chunkOut, lastNewLine + 1, std::string::npos);
+            chunkOut.resize(lastNewLine + 1);
+            break;
+        }
+
+        if (chunkOut.size() > gs_MAX_TRACE_LINE_LENGTH)
+        {
+            std::cerr << "Error in DispatchTraceReader::ReadChunk(): A row of the trace is longer than "
+                      << gs_MAX_TRACE_LINE_LENGTH << " bytes, the trace is corrupt.\n";
+            m_failed = true;
+            chunkOut.clear();
+            return false;
+        }
+    }
+
+    if (!chunkOut.empty() && '\n' != chunkOut[chunkOut.size() - 1])
+    {
+        chunkOut.push_back('\n');
+    }
+
+    return !chunkOut.empty();
+}
+
+bool DispatchTraceReader::Failed() const
+{
+    return m_failed;
+}
+
+const DispatchTraceLayout& DispatchTraceReader::Layout() const
+{
+    return m_layout;
+}
+
+// ------------------ Definitions of DispatchTraceWriter -----------------------
+
+DispatchTraceWriter::DispatchTraceWriter()
+{
+}
+
+bool DispatchTraceWriter::Open(const std::string& fileName)
+{
+    m_file.open(fileName, std::ios::binary | std::ios::trunc);
+
+    if (!m_file.good())
+    {
+        std::cerr << "Error in DispatchTraceWriter::Open(): Error when open file \"" << fileName << "\"\n";
+        return false;
+    }
+
+    const std::size_t columnCount = sizeof(gs_COLUMN_NAMES) / sizeof(gs_COLUMN_NAMES[0]);
+
+    for (std::size_t i = 0; i < columnCount; ++i)
+    {
+        m_file << (0 == i ? "" : ",") << gs_COLUMN_NAMES[i];
+    }
+
+    m_file << "\n";
+    return m_file.good();
+}
+
+bool DispatchTraceWriter::WriteRecord(const DispatchTraceRecord& record)
+{
+    // Same column order as gs_COLUMN_NAMES
+    m_file << std::dec << record.m_index << ","
+           << record.m_queueId << ","
+           << record.m_packetId << ","
+           << record.m_kernelName << ","
+           << record.m_header << ","
+           << record.m_setup << ","
+           << "{" << record.m_workgroupSize[0] << " " << record.m_workgroupSize[1] << " " << record.m_workgroupSize[2] << "},"
+           << "0,"
+           << "{" << record.m_gridSize[0] << " " << record.m_gridSize[1] << " " << record.m_gridSize[2] << "},"
+           << record.m_privateSegmentSize << ","
+           << record.m_groupSegmentSize << ","
+           << record.m_kernelObject << ","
+           // Only the kernel argument address is hexadecimal in the "set rocm trace" layout
+           << std::hex << std::showbase
+           << record.m_kernargAddress << ","
+           << std::noshowbase << std::dec
+           << "0,"
+           << record.m_completionSignal << ","
+           << record.m_device << ",";
+
+    if (record.m_hasTiming)
+    {
+        m_file << record.m_gpuStart << "," << record.m_gpuEnd << ",";
+    }
+    else
+    {
+        m_file << ",,";
+    }
+
+    if (record.m_hasHostTiming)
+    {
+        m_file << record.m_hostEnqueue << "," << record.m_hostComplete;
+    }
+    else
+    {
+        m_file << ",";
+    }
+
+    m_file << "\n";
+    return m_file.good();
+}
+
+bool DispatchTraceWriter::Close()
+{
+    if (!m_file.is_open())
+    {
+        return true;
+    }
+
+    m_file.close();
+
+    if (m_file.fail())
+    {
+        std::cerr << "Error in DispatchTraceWriter::Close(): Error when writing the trace.\n";
+        return false;
+    }
+
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+
+std::string EscapeJson(const std::string& str)
+{
+    std::string ret;
+    ret.reserve(str.size());
+
+    for (std::size_t i = 0; i < str.size(); ++i)
+    {
+        unsigned char c = static_cast<unsigned char>(str[i]);
+
+        if ('"' == c || '\\' == c)
+        {
+            ret.push_back('\\');
+            ret.push_back(static_cast<char>(c));
+        }
+        else if (c < 0x20)
+        {
+            static const char s_hexDigits[] = "0123456789abcdef";
+            ret += "\\u00";
+            ret.push_back(s_hexDigits[c >> 4]);
+            ret.push_back(s_hexDigits[c & 0xf]);
+        }
+        else
+        {
+            ret.push_back(static_cast<char>(c));
+        }
+    }
+
+    return ret;
+}
+
+} // namespace AMDT
@@ -0,0 +1,268 @@
+//==============================================================================
+// Copyright (c) 2017 Advanced Micro Devices, Inc. All rights reserved.
+//
+/// \author AMD Developer Tools
+/// \file
+/// \brief  Streaming reader and writer for the GPU dispatch trace saved by "set rocm trace"
+//==============================================================================
+#ifndef DISPATCH_TRACE_READER_H_
+#define DISPATCH_TRACE_READER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace AMDT
+{
+
+/// Default number of bytes read per chunk of a dispatch trace
+static const std::size_t gs_TRACE_CHUNK_SIZE = 16 * 1024 * 1024;
+
+/// Longest row accepted in a dispatch trace, a longer row means the trace is corrupt
+static const std::size_t gs_MAX_TRACE_LINE_LENGTH = 1024 * 1024;
+
+/// \brief A struct holding one row of the dispatch trace
+typedef struct DispatchTraceRecord
+{
+    // Index of the dispatch in the trace
+    uint64_t m_index;
+
+    // Queue and packet the kernel was dispatched on
+    uint64_t m_queueId;
+    uint64_t m_packetId;
+
+    // Device the queue belongs to, 0 if the trace has no device column
+    uint64_t m_device;
+
+    // Kernel name, may contain commas for demangled names
+    std::string m_kernelName;
+
+    // AQL packet fields
+    uint16_t m_header;
+    uint16_t m_setup;
+    uint32_t m_workgroupSize[3];
+    uint32_t m_gridSize[3];
+    uint32_t m_privateSegmentSize;
+    uint32_t m_groupSegmentSize;
+    uint64_t m_kernelObject;
+    uint64_t m_kernargAddress;
+    uint64_t m_completionSignal;
+
+    // GPU start and end timestamps in nanoseconds, only valid if m_hasTiming is true
+    bool     m_hasTiming;
+    uint64_t m_gpuStart;
+    uint64_t m_gpuEnd;
+
+    // Host-side enqueue and completion times in nanoseconds, only valid if m_hasHostTiming is true
+    bool     m_hasHostTiming;
+    uint64_t m_hostEnqueue;
+    uint64_t m_hostComplete;
+
+    DispatchTraceRecord();
+} DispatchTraceRecord;
+
+// -----------------------------------------------------------------------------
+
+/// \brief Column positions of a dispatch trace, taken from its header row
+class DispatchTraceLayout
+{
+public:
+    /// \brief Constructor, set up the default "set rocm trace" column layout
+    DispatchTraceLayout();
+
+    /// \brief Set up the column layout from a header row.
+    ///
+    /// \param[in] headerLine The first line of the trace, without the line terminator
+    /// \return true if the line is a header row, false if it is a data row
+    bool ParseHeader(const std::string& headerLine);
+
+    /// \brief Parse one data row of the trace.
+    ///
+    /// \param[in]  pBegin    First character of the row
+    /// \param[in]  pEnd      One past the last character of the row, without the line terminator
+    /// \param[out] recordOut The parsed record
+    /// \return true if the row is a valid dispatch record
+    bool ParseRecord(const char* pBegin, const char* pEnd, DispatchTraceRecord& recordOut) const;
+
+    /// \brief return whether the trace carries GPU timestamps
+    ///
+    /// \return true if both timestamp columns are present
+    bool HasTiming() const;
+
+    /// \brief return whether the trace carries host-side enqueue and completion times
+    ///
+    /// \return true if both host time columns are present
+    bool HasHostTiming() const;
+
+private:
+    /// The columns known to the reader
+    enum Column
+    {
+        COLUMN_INDEX,
+        COLUMN_QUEUE_ID,
+        COLUMN_PACKET_ID,
+        COLUMN_KERNEL_NAME,
+        COLUMN_HEADER,
+        COLUMN_SETUP,
+        COLUMN_WORKGROUP_SIZE,
+        COLUMN_RESERVED0,
+        COLUMN_GRID_SIZE,
+        COLUMN_PRIVATE_SEGMENT_SIZE,
+        COLUMN_GROUP_SEGMENT_SIZE,
+        COLUMN_KERNEL_OBJECT,
+        COLUMN_KERNARG_ADDRESS,
+        COLUMN_RESERVED2,
+        COLUMN_COMPLETION_SIGNAL,
+        COLUMN_DEVICE,
+        COLUMN_GPU_START,
+        COLUMN_GPU_END,
+        COLUMN_HOST_ENQUEUE,
+        COLUMN_HOST_COMPLETE,
+        COLUMN_COUNT
+    };
+
+    std::vector<int> m_columnOf;    ///< position of each Column in a row, -1 if not present
+    std::size_t      m_fieldCount;  ///< number of fields in a row
+};
+
+// -----------------------------------------------------------------------------
+
+/// \brief Read a dispatch trace file in chunks of complete rows, so that traces of
+///        any size are processed in constant memory.
+class DispatchTraceReader
+{
+public:
+    /// Constructor
+    DispatchTraceReader();
+
+    /// \brief Open a trace file and read its header row.
+    ///
+    /// \param[in] fileName The trace file
+    /// \return true if there is no error
+    bool Open(const std::string& fileName);
+
+    /// \brief Read the next chunk of rows.
+    ///
+    /// \param[out] chunkOut  Complete rows, each terminated by a newline
+    /// \param[in]  chunkSize Approximate number of bytes to read
+    /// \return true if a chunk was read, false at the end of the trace or on error (see Failed())
+    bool ReadChunk(std::string& chunkOut, std::size_t chunkSize = gs_TRACE_CHUNK_SIZE);
+
+    /// \brief return whether ReadChunk() stopped on an error rather than at the end of the trace
+    ///
+    /// \return true if a row longer than gs_MAX_TRACE_LINE_LENGTH was found
+    bool Failed() const;
+
+    /// \brief return the column layout of the opened trace
+    ///
+    /// \return the column layout
+    const DispatchTraceLayout& Layout() const;
+
+private:
+    /// disable copy constructor
+    DispatchTraceReader(const DispatchTraceReader&);
+
+    /// disable assignment operator
+    DispatchTraceReader& operator=(const DispatchTraceReader&);
+
+    std::ifstream       m_file;       ///< the trace file
+    std::string         m_carry;      ///< partial row left over from the previous chunk
+    DispatchTraceLayout m_layout;     ///< column layout of the trace
+    bool                m_failed;     ///< set when the trace is found to be corrupt
+};
+
+/// \brief Write a dispatch trace in the "set rocm trace" layout, followed by the device,
+///        GPU timestamp and host time columns, so that it can be read back by DispatchTraceReader.
+class DispatchTraceWriter
+{
+public:
+    /// Constructor
+    DispatchTraceWriter();
+
+    /// \brief Create a trace file and write its header row.
+    ///
+    /// \param[in] fileName The trace file
+    /// \return true if there is no error
+    bool Open(const std::string& fileName);
+
+    /// \brief Write one data row, the GPU timestamp columns are left empty if record.m_hasTiming is false
+    ///        and the host time columns if record.m_hasHostTiming is false.
+    ///
+    /// \param[in] record The dispatch record
+    /// \return true if there is no error
+    bool WriteRecord(const DispatchTraceRecord& record);
+
+    /// \brief Flush and close the trace file.
+    ///
+    /// \return true if every row was written
+    bool Close();
+
+private:
+    /// disable copy constructor
+    DispatchTraceWriter(const DispatchTraceWriter&);
+
+    /// disable assignment operator
+    DispatchTraceWriter& operator=(const DispatchTraceWriter&);
+
+    std::ofstream m_file;   ///< the trace file
+};
+
+/// \brief Call a function for every record in a chunk returned by DispatchTraceReader::ReadChunk().
+///
+/// \param[in] layout   The column layout of the trace
+/// \param[in] chunk    Complete rows, each terminated by a newline
+/// \param[in] callback Called with every valid record
+/// \return number of rows that could not be parsed
+template <typename Callback>
+std::size_t ForEachRecord(const DispatchTraceLayout& layout, const std::string& chunk, Callback callback)
+{
+    std::size_t badRows = 0;
+    DispatchTraceRecord record;
+    const char* pRow = chunk.data();
+    const char* pChunkEnd = chunk.data() + chunk.size();
+
+    while (pRow < pChunkEnd)
+    {
+        const char* pRowEnd = pRow;
+
+        while (pRowEnd < pChunkEnd && '\n' != *pRowEnd)
+        {
+            ++pRowEnd;
+        }
+
+        const char* pNext = pRowEnd + 1;
+
+        if (pRowEnd > pRow && '\r' == *(pRowEnd - 1))
+        {
+            --pRowEnd;
+        }
+
+        if (pRowEnd > pRow)
+        {
+            if (layout.ParseRecord(pRow, pRowEnd, record))
+            {
+                callback(record);
+            }
+            else
+            {
+                ++badRows;
+            }
+        }
+
+        pRow = pNext;
+    }
+
+    return badRows;
+}
+
+/// \brief Escape a string, such as a kernel name, for the JSON output of the trace tools.
+///
+/// \param[in] str The string to escape
+/// \return the escaped string, without the enclosing quotes
+std::string EscapeJson(const std::string& str);
+
+} // namespace AMDT
+
+#endif // DISPATCH_TRACE_READER_H_
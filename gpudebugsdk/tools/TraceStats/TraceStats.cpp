@@ -0,0 +1,561 @@
+//==============================================================================
+// Copyright (c) 2017 Advanced Micro Devices, Inc. All rights reserved.
+//
+/// \author AMD Developer Tools
+/// \file
+/// \brief  rocm-trace-stats: aggregate a GPU dispatch trace saved by
+///         "set rocm trace" per kernel name.  The trace is streamed in
+///         chunks that are parsed by a pool of worker threads, so memory
+///         use only depends on the number of distinct kernels and shapes.
+//==============================================================================
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "DispatchTraceReader.h"
+
+// Number of chunks queued ahead of the worker threads, per worker
+static const std::size_t gs_CHUNKS_PER_WORKER = 2;
+
+// Number of histogram sub-buckets per power of two, gives percentiles within ~6%
+static const unsigned int gs_HISTOGRAM_SUB_BUCKET_BITS = 4;
+static const unsigned int gs_HISTOGRAM_SUB_BUCKETS = 1u << gs_HISTOGRAM_SUB_BUCKET_BITS;
+static const unsigned int gs_HISTOGRAM_BUCKETS = 64 * gs_HISTOGRAM_SUB_BUCKETS;
+
+// ================================= Data structures ==================================================
+
+/// \brief Fixed size log-linear histogram of dispatch durations, used for percentiles
+///        without keeping every sample.
+class DurationHistogram
+{
+public:
+    DurationHistogram() : m_counts(gs_HISTOGRAM_BUCKETS, 0) {}
+
+    void Add(uint64_t value)
+    {
+        ++m_counts[BucketOf(value)];
+    }
+
+    void Merge(const DurationHistogram& other)
+    {
+        for (std::size_t i = 0; i < m_counts.size(); ++i)
+        {
+            m_counts[i] += other.m_counts[i];
+        }
+    }
+
+    /// \brief Return the approximate value at the given percentile (0-100) of totalCount samples
+    uint64_t Percentile(double percentile, uint64_t totalCount) const
+    {
+        if (0 == totalCount)
+        {
+            return 0;
+        }
+
+        uint64_t rank = static_cast<uint64_t>(percentile / 100.0 * static_cast<double>(totalCount - 1)) + 1;
+        uint64_t seen = 0;
+
+        for (std::size_t i = 0; i < m_counts.size(); ++i)
+        {
+            seen += m_counts[i];
+
+            if (seen >= rank)
+            {
+                return BucketMidpoint(static_cast<unsigned int>(i));
+            }
+        }
+
+        return BucketMidpoint(gs_HISTOGRAM_BUCKETS - 1);
+    }
+
+private:
+    static unsigned int BucketOf(uint64_t value)
+    {
+        if (value < gs_HISTOGRAM_SUB_BUCKETS)
+        {
+            return static_cast<unsigned int>(value);
+        }
+
+        unsigned int msb = 63 - __builtin_clzll(value);
+        unsigned int shift = msb - gs_HISTOGRAM_SUB_BUCKET_BITS;
+        unsigned int subBucket = static_cast<unsigned int>(value >> shift) & (gs_HISTOGRAM_SUB_BUCKETS - 1);
+        return (shift + 1) * gs_HISTOGRAM_SUB_BUCKETS + subBucket;
+    }
+
+    static uint64_t BucketMidpoint(unsigned int bucket)
+    {
+        if (bucket < gs_HISTOGRAM_SUB_BUCKETS)
+        {
+            return bucket;
+        }
+
+        unsigned int shift = bucket / gs_HISTOGRAM_SUB_BUCKETS - 1;
+        uint64_t low = (static_cast<uint64_t>(gs_HISTOGRAM_SUB_BUCKETS + bucket % gs_HISTOGRAM_SUB_BUCKETS)) << shift;
+        return low + ((1ull << shift) >> 1);
+    }
+
+    std::vector<uint64_t> m_counts;
+};
+
+/// \brief A grid or work-group shape, used as a key of the shape counts
+typedef struct Dim3
+{
+    uint32_t m_size[3];
+
+    Dim3(const uint32_t size[3])
+    {
+        m_size[0] = size[0];
+        m_size[1] = size[1];
+        m_size[2] = size[2];
+    }
+
+    bool operator<(const Dim3& other) const
+    {
+        return std::lexicographical_compare(m_size, m_size + 3, other.m_size, other.m_size + 3);
+    }
+} Dim3;
+
+typedef std::map<Dim3, uint64_t> ShapeCountMap;
+
+/// \brief Aggregated statistics of all the dispatches of one kernel
+typedef struct KernelStats
+{
+    uint64_t m_count;
+    uint64_t m_timedCount;
+    uint64_t m_totalDuration;
+    uint64_t m_minDuration;
+    uint64_t m_maxDuration;
+    DurationHistogram m_durations;
+
+    uint32_t m_minPrivateSegmentSize;
+    uint32_t m_maxPrivateSegmentSize;
+    uint32_t m_minGroupSegmentSize;
+    uint32_t m_maxGroupSegmentSize;
+
+    // Distinct shapes and their dispatch counts
+    ShapeCountMap m_gridShapes;
+    ShapeCountMap m_workgroupShapes;
+
+    KernelStats() : m_count(0), m_timedCount(0), m_totalDuration(0), m_minDuration(UINT64_MAX), m_maxDuration(0),
+                    m_minPrivateSegmentSize(UINT32_MAX), m_maxPrivateSegmentSize(0),
+                    m_minGroupSegmentSize(UINT32_MAX), m_maxGroupSegmentSize(0)
+    {}
+} KernelStats;
+
+typedef std::unordered_map<std::string, KernelStats> KernelStatsMap;
+
+/// \brief Chunks read from the trace, waiting to be parsed by the workers
+typedef struct ChunkQueue
+{
+    std::mutex m_mutex;
+    std::condition_variable m_notEmpty;
+    std::condition_variable m_notFull;
+    std::deque<std::string> m_chunks;
+    std::size_t m_maxChunks;
+    bool m_done;
+
+    ChunkQueue() : m_maxChunks(1), m_done(false) {}
+} ChunkQueue;
+
+// ================================= Functions declaration ============================================
+
+// Add a record to the per-kernel statistics.
+void AddRecord(const AMDT::DispatchTraceRecord& record, KernelStatsMap& statsMap);
+
+// Merge the statistics collected by a worker into the totals.
+void MergeStats(const KernelStatsMap& from, KernelStatsMap& to);
+
+// Worker thread, parses the chunks of the queue into its own statistics.
+void ParseChunks(const AMDT::DispatchTraceLayout& layout, ChunkQueue& queue, KernelStatsMap& statsOut, std::size_t& badRowsOut);
+
+// Output the statistics as a table.
+void OutputTable(const std::vector<const KernelStatsMap::value_type*>& kernels, bool hasTiming);
+
+// Output the statistics as JSON.
+void OutputJson(const std::vector<const KernelStatsMap::value_type*>& kernels, bool hasTiming);
+
+// Helper function to format a dimension as "{x y z}".
+std::string FormatDim3(const uint32_t dim[3]);
+
+// =====================================================================================================
+
+int main(int argc, char** argv)
+{
+    bool outputJson = false;
+    unsigned int threadCount = std::max(1u, std::thread::hardware_concurrency());
+    std::string traceFile;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string ipOption(argv[i]);
+
+        if (ipOption == "--json")
+        {
+            outputJson = true;
+        }
+        else if (ipOption == "--threads" && i + 1 < argc)
+        {
+            threadCount = std::max(1u, static_cast<unsigned int>(strtoul(argv[++i], nullptr, 10)));
+        }
+        else if (traceFile.empty() && '-' != ipOption[0])
+        {
+            traceFile = ipOption;
+        }
+        else
+        {
+            traceFile.clear();
+            break;
+        }
+    }
+
+    if (traceFile.empty())
+    {
+        std::cout << "rocm-trace-stats aggregates a GPU dispatch trace saved by \"set rocm trace\" per kernel\n";
+        std::cout << "Usage: rocm-trace-stats [options] <trace file>\n";
+        std::cout << "Possible options\n";
+        std::cout << " \t--json\t\t output JSON instead of a table\n";
+        std::cout << " \t--threads <N>\t number of parser threads (default: number of cores)\n";
+        return 1;
+    }
+
+    AMDT::DispatchTraceReader reader;
+
+    if (!reader.Open(traceFile))
+    {
+        std::cerr << "Error in main(): Cannot read trace file \"" << traceFile << "\"\n";
+        return 1;
+    }
+
+    ChunkQueue queue;
+    queue.m_maxChunks = threadCount * gs_CHUNKS_PER_WORKER;
+
+    std::vector<KernelStatsMap> workerStats(threadCount);
+    std::vector<std::size_t> workerBadRows(threadCount, 0);
+    std::vector<std::thread> workers;
+
+    for (unsigned int i = 0; i < threadCount; ++i)
+    {
+        workers.push_back(std::thread(ParseChunks, std::cref(reader.Layout()), std::ref(queue),
+                                      std::ref(workerStats[i]), std::ref(workerBadRows[i])));
+    }
+
+    std::string chunk;
+
+    while (reader.ReadChunk(chunk))
+    {
+        std::unique_lock<std::mutex> lock(queue.m_mutex);
+
+        while (queue.m_chunks.size() >= queue.m_maxChunks)
+        {
+            queue.m_notFull.wait(lock);
+        }
+
+        queue.m_chunks.push_back(std::string());
+        queue.m_chunks.back().swap(chunk);
+        queue.m_notEmpty.notify_one();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(queue.m_mutex);
+        queue.m_done = true;
+    }
+
+    queue.m_notEmpty.notify_all();
+
+    KernelStatsMap totalStats;
+    std::size_t badRows = 0;
+
+    for (unsigned int i = 0; i < threadCount; ++i)
+    {
+        workers[i].join();
+        MergeStats(workerStats[i], totalStats);
+        badRows += workerBadRows[i];
+    }
+
+    if (reader.Failed())
+    {
+        std::cerr << "Error in main(): Cannot read trace file \"" << traceFile << "\"\n";
+        return 1;
+    }
+
+    if (0 != badRows)
+    {
+        std::cerr << "Warning: " << badRows << " rows of \"" << traceFile << "\" could not be parsed and were skipped.\n";
+    }
+
+    // Sort by total duration if the trace has timing, otherwise by dispatch count
+    std::vector<const KernelStatsMap::value_type*> kernels;
+
+    for (KernelStatsMap::const_iterator iter = totalStats.begin(); iter != totalStats.end(); ++iter)
+    {
+        kernels.push_back(&(*iter));
+    }
+
+    std::sort(kernels.begin(), kernels.end(),
+              [](const KernelStatsMap::value_type* pA, const KernelStatsMap::value_type* pB)
+    {
+        if (pA->second.m_totalDuration != pB->second.m_totalDuration)
+        {
+            return pA->second.m_totalDuration > pB->second.m_totalDuration;
+        }
+
+        if (pA->second.m_count != pB->second.m_count)
+        {
+            return pA->second.m_count > pB->second.m_count;
+        }
+
+        return pA->first < pB->first;
+    });
+
+    if (outputJson)
+    {
+        OutputJson(kernels, reader.Layout().HasTiming());
+    }
+    else
+    {
+        OutputTable(kernels, reader.Layout().HasTiming());
+    }
+
+    return 0;
+}
+
+void ParseChunks(const AMDT::DispatchTraceLayout& layout, ChunkQueue& queue, KernelStatsMap& statsOut, std::size_t& badRowsOut)
+{
+    std::string chunk;
+
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(queue.m_mutex);
+
+            while (queue.m_chunks.empty() && !queue.m_done)
+            {
+                queue.m_notEmpty.wait(lock);
+            }
+
+            if (queue.m_chunks.empty())
+            {
+                return;
+            }
+
+            chunk.swap(queue.m_chunks.front());
+            queue.m_chunks.pop_front();
+        }
+
+        queue.m_notFull.notify_one();
+
+        badRowsOut += AMDT::ForEachRecord(layout, chunk,
+                                          [&statsOut](const AMDT::DispatchTraceRecord& record)
+        {
+            AddRecord(record, statsOut);
+        });
+    }
+}
+
+void AddRecord(const AMDT::DispatchTraceRecord& record, KernelStatsMap& statsMap)
+{
+    KernelStats& stats = statsMap[record.m_kernelName];
+
+    stats.m_count++;
+
+    if (record.m_hasTiming)
+    {
+        uint64_t duration = record.m_gpuEnd - record.m_gpuStart;
+        stats.m_timedCount++;
+        stats.m_totalDuration += duration;
+        stats.m_minDuration = std::min(stats.m_minDuration, duration);
+        stats.m_maxDuration = std::max(stats.m_maxDuration, duration);
+        stats.m_durations.Add(duration);
+    }
+
+    stats.m_minPrivateSegmentSize = std::min(stats.m_minPrivateSegmentSize, record.m_privateSegmentSize);
+    stats.m_maxPrivateSegmentSize = std::max(stats.m_maxPrivateSegmentSize, record.m_privateSegmentSize);
+    stats.m_minGroupSegmentSize = std::min(stats.m_minGroupSegmentSize, record.m_groupSegmentSize);
+    stats.m_maxGroupSegmentSize = std::max(stats.m_maxGroupSegmentSize, record.m_groupSegmentSize);
+
+    stats.m_gridShapes[Dim3(record.m_gridSize)]++;
+    stats.m_workgroupShapes[Dim3(record.m_workgroupSize)]++;
+}
+
+void MergeStats(const KernelStatsMap& from, KernelStatsMap& to)
+{
+    for (KernelStatsMap::const_iterator iter = from.begin(); iter != from.end(); ++iter)
+    {
+        const KernelStats& src = iter->second;
+        KernelStats& dst = to[iter->first];
+
+        dst.m_count += src.m_count;
+        dst.m_timedCount += src.m_timedCount;
+        dst.m_totalDuration += src.m_totalDuration;
+        dst.m_minDuration = std::min(dst.m_minDuration, src.m_minDuration);
+        dst.m_maxDuration = std::max(dst.m_maxDuration, src.m_maxDuration);
+        dst.m_durations.Merge(src.m_durations);
+
+        dst.m_minPrivateSegmentSize = std::min(dst.m_minPrivateSegmentSize, src.m_minPrivateSegmentSize);
+        dst.m_maxPrivateSegmentSize = std::max(dst.m_maxPrivateSegmentSize, src.m_maxPrivateSegmentSize);
+        dst.m_minGroupSegmentSize = std::min(dst.m_minGroupSegmentSize, src.m_minGroupSegmentSize);
+        dst.m_maxGroupSegmentSize = std::max(dst.m_maxGroupSegmentSize, src.m_maxGroupSegmentSize);
+
+        for (ShapeCountMap::const_iterator shape = src.m_gridShapes.begin(); shape != src.m_gridShapes.end(); ++shape)
+        {
+            dst.m_gridShapes[shape->first] += shape->second;
+        }
+
+        for (ShapeCountMap::const_iterator shape = src.m_workgroupShapes.begin(); shape != src.m_workgroupShapes.end(); ++shape)
+        {
+            dst.m_workgroupShapes[shape->first] += shape->second;
+        }
+    }
+}
+
+// Format a segment size range as "min" or "min-max".
+static std::string FormatRange(uint32_t minValue, uint32_t maxValue)
+{
+    std::ostringstream ss;
+    ss << minValue;
+
+    if (maxValue != minValue)
+    {
+        ss << "-" << maxValue;
+    }
+
+    return ss.str();
+}
+
+// Format a list of shapes as "{x y z}:count {x y z}:count".
+static std::string FormatShapes(const ShapeCountMap& shapes)
+{
+    std::ostringstream ss;
+
+    for (ShapeCountMap::const_iterator iter = shapes.begin(); iter != shapes.end(); ++iter)
+    {
+        if (iter != shapes.begin())
+        {
+            ss << " ";
+        }
+
+        ss << FormatDim3(iter->first.m_size) << ":" << iter->second;
+    }
+
+    return ss.str();
+}
+
+void OutputTable(const std::vector<const KernelStatsMap::value_type*>& kernels, bool hasTiming)
+{
+    std::size_t nameWidth = 11;
+
+    for (std::size_t i = 0; i < kernels.size(); ++i)
+    {
+        nameWidth = std::max(nameWidth, kernels[i]->first.size());
+    }
+
+    std::cout << std::left << std::setw(static_cast<int>(nameWidth)) << "kernel_name" << std::right
+              << std::setw(12) << "count";
+
+    if (hasTiming)
+    {
+        std::cout << std::setw(14) << "total(us)" << std::setw(12) << "mean(us)"
+                  << std::setw(12) << "p50(us)" << std::setw(12) << "p99(us)";
+    }
+
+    std::cout << std::setw(8) << "grids" << std::setw(8) << "wgs"
+              << std::setw(16) << "private_seg" << std::setw(16) << "group_seg" << "\n";
+
+    std::cout << std::fixed << std::setprecision(1);
+
+    for (std::size_t i = 0; i < kernels.size(); ++i)
+    {
+        const KernelStats& stats = kernels[i]->second;
+
+        std::cout << std::left << std::setw(static_cast<int>(nameWidth)) << kernels[i]->first << std::right
+                  << std::setw(12) << stats.m_count;
+
+        if (hasTiming)
+        {
+            double mean = (0 == stats.m_timedCount) ? 0.0 : static_cast<double>(stats.m_totalDuration) / stats.m_timedCount;
+            std::cout << std::setw(14) << stats.m_totalDuration / 1e3
+                      << std::setw(12) << mean / 1e3
+                      << std::setw(12) << stats.m_durations.Percentile(50, stats.m_timedCount) / 1e3
+                      << std::setw(12) << stats.m_durations.Percentile(99, stats.m_timedCount) / 1e3;
+        }
+
+        std::cout << std::setw(8) << stats.m_gridShapes.size() << std::setw(8) << stats.m_workgroupShapes.size()
+                  << std::setw(16) << FormatRange(stats.m_minPrivateSegmentSize, stats.m_maxPrivateSegmentSize)
+                  << std::setw(16) << FormatRange(stats.m_minGroupSegmentSize, stats.m_maxGroupSegmentSize) << "\n";
+    }
+
+    std::cout << "\n";
+
+    for (std::size_t i = 0; i < kernels.size(); ++i)
+    {
+        const KernelStats& stats = kernels[i]->second;
+        std::cout << kernels[i]->first << "\n";
+        std::cout << "\tgrid_size:      " << FormatShapes(stats.m_gridShapes) << "\n";
+        std::cout << "\tworkgroup_size: " << FormatShapes(stats.m_workgroupShapes) << "\n";
+    }
+}
+
+// Output a list of shapes as a JSON object.
+static void OutputJsonShapes(const ShapeCountMap& shapes)
+{
+    std::cout << "{";
+
+    for (ShapeCountMap::const_iterator iter = shapes.begin(); iter != shapes.end(); ++iter)
+    {
+        std::cout << ((iter == shapes.begin()) ? "" : ", ") << "\"" << FormatDim3(iter->first.m_size) << "\": " << iter->second;
+    }
+
+    std::cout << "}";
+}
+
+void OutputJson(const std::vector<const KernelStatsMap::value_type*>& kernels, bool hasTiming)
+{
+    std::cout << "[\n";
+
+    for (std::size_t i = 0; i < kernels.size(); ++i)
+    {
+        const KernelStats& stats = kernels[i]->second;
+
+        std::cout << "  {\"kernel_name\": \"" << AMDT::EscapeJson(kernels[i]->first) << "\""
+                  << ", \"count\": " << stats.m_count;
+
+        if (hasTiming && 0 != stats.m_timedCount)
+        {
+            std::cout << ", \"timed_count\": " << stats.m_timedCount
+                      << ", \"total_ns\": " << stats.m_totalDuration
+                      << ", \"mean_ns\": " << stats.m_totalDuration / stats.m_timedCount
+                      << ", \"min_ns\": " << stats.m_minDuration
+                      << ", \"max_ns\": " << stats.m_maxDuration
+                      << ", \"p50_ns\": " << stats.m_durations.Percentile(50, stats.m_timedCount)
+                      << ", \"p99_ns\": " << stats.m_durations.Percentile(99, stats.m_timedCount);
+        }
+
+        std::cout << ", \"private_segment_size\": [" << stats.m_minPrivateSegmentSize << ", " << stats.m_maxPrivateSegmentSize << "]"
+                  << ", \"group_segment_size\": [" << stats.m_minGroupSegmentSize << ", " << stats.m_maxGroupSegmentSize << "]"
+                  << ", \"grid_size\": ";
+        OutputJsonShapes(stats.m_gridShapes);
+        std::cout << ", \"workgroup_size\": ";
+        OutputJsonShapes(stats.m_workgroupShapes);
+        std::cout << "}" << ((i + 1 < kernels.size()) ? "," : "") << "\n";
+    }
+
+    std::cout << "]\n";
+}
+
+std::string FormatDim3(const uint32_t dim[3])
+{
+    std::ostringstream ss;
+    ss << "{" << dim[0] << " " << dim[1] << " " << dim[2] << "}";
+    return ss.str();
+}
@@ -0,0 +1,177 @@
+//==============================================================================
+// Copyright (c) 2017 Advanced Micro Devices, Inc. All rights reserved.
+//
+/// \author AMD Developer Tools
+/// \file
+/// \brief  rocm-trace-timeline: convert a GPU dispatch trace saved by
+///         "set rocm trace" to the Chrome trace event JSON format, which
+///         can be loaded in chrome://tracing or the Perfetto UI.  Each
+///         device is shown as a process and each queue as a thread.  The
+///         output is written while the trace is read, so traces of any
+///         size are converted in constant memory.
+//==============================================================================
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <set>
+#include <string>
+#include <utility>
+
+#include "DispatchTraceReader.h"
+
+// ================================= Functions declaration ============================================
+
+// Output the separator before an event of the traceEvents array, unless it is the first one.
+void OutputSeparator(std::ostream& out, bool& isFirstEvent);
+
+// Output the metadata events naming the track of a device and queue.
+void OutputTrackNames(std::ostream& out, uint64_t device, uint64_t queueId, bool isNewDevice, bool& isFirstEvent);
+
+// Output a complete event for a dispatch.
+void OutputDispatch(std::ostream& out, const AMDT::DispatchTraceRecord& record, bool hasTiming, bool& isFirstEvent);
+
+// =====================================================================================================
+
+int main(int argc, char** argv)
+{
+    if (argc < 2 || argc > 3 || '-' == argv[1][0])
+    {
+        std::cout << "rocm-trace-timeline converts a GPU dispatch trace saved by \"set rocm trace\" to Chrome trace event JSON\n";
+        std::cout << "Usage: rocm-trace-timeline <trace file> [<output file>]\n";
+        std::cout << "The JSON is written to the standard output if no output file is given.\n";
+        return 1;
+    }
+
+    const std::string traceFile(argv[1]);
+    AMDT::DispatchTraceReader reader;
+
+    if (!reader.Open(traceFile))
+    {
+        std::cerr << "Error in main(): Cannot read trace file \"" << traceFile << "\"\n";
+        return 1;
+    }
+
+    std::ofstream outFile;
+
+    if (3 == argc)
+    {
+        outFile.open(argv[2]);
+
+        if (!outFile.is_open())
+        {
+            std::cerr << "Cannot open file " << argv[2] << "\n";
+            return 1;
+        }
+    }
+
+    std::ostream& out = (3 == argc) ? outFile : std::cout;
+    const bool hasTiming = reader.Layout().HasTiming();
+
+    if (!hasTiming)
+    {
+        std::cerr << "Warning: \"" << traceFile << "\" has no gpu_start_ns/gpu_end_ns columns, "
+                  << "dispatches are placed 1us apart in dispatch order.\n";
+    }
+
+    // Only the set of tracks is kept in memory, events are written as they are read
+    std::set<uint64_t> devices;
+    std::set<std::pair<uint64_t, uint64_t> > tracks;
+    std::size_t badRows = 0;
+    std::size_t untimedRows = 0;
+    bool isFirstEvent = true;
+    std::string chunk;
+
+    out << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n";
+    out << std::fixed << std::setprecision(3);
+
+    while (reader.ReadChunk(chunk))
+    {
+        badRows += AMDT::ForEachRecord(reader.Layout(), chunk,
+                                       [&](const AMDT::DispatchTraceRecord& record)
+        {
+            if (hasTiming && !record.m_hasTiming)
+            {
+                ++untimedRows;
+                return;
+            }
+
+            if (tracks.insert(std::make_pair(record.m_device, record.m_queueId)).second)
+            {
+                OutputTrackNames(out, record.m_device, record.m_queueId, devices.insert(record.m_device).second, isFirstEvent);
+            }
+
+            OutputDispatch(out, record, hasTiming, isFirstEvent);
+        });
+    }
+
+    out << "\n]}\n";
+
+    if (reader.Failed())
+    {
+        std::cerr << "Error in main(): Cannot read trace file \"" << traceFile << "\"\n";
+        return 1;
+    }
+
+    if (0 != badRows)
+    {
+        std::cerr << "Warning: " << badRows << " rows of \"" << traceFile << "\" could not be parsed and were skipped.\n";
+    }
+
+    if (0 != untimedRows)
+    {
+        std::cerr << "Warning: " << untimedRows << " dispatches without timestamps were skipped.\n";
+    }
+
+    out.flush();
+    return out.good() ? 0 : 1;
+}
+
+void OutputSeparator(std::ostream& out, bool& isFirstEvent)
+{
+    if (!isFirstEvent)
+    {
+        out << ",\n";
+    }
+
+    isFirstEvent = false;
+}
+
+void OutputTrackNames(std::ostream& out, uint64_t device, uint64_t queueId, bool isNewDevice, bool& isFirstEvent)
+{
+    if (isNewDevice)
+    {
+        OutputSeparator(out, isFirstEvent);
+        out << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << device
+            << ", \"args\": {\"name\": \"GPU device " << device << "\"}}";
+    }
+
+    OutputSeparator(out, isFirstEvent);
+    out << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " << device << ", \"tid\": " << queueId
+        << ", \"args\": {\"name\": \"queue " << queueId << "\"}}";
+}
+
+void OutputDispatch(std::ostream& out, const AMDT::DispatchTraceRecord& record, bool hasTiming, bool& isFirstEvent)
+{
+    // Timestamps are in microseconds in the trace event format
+    double start = static_cast<double>(record.m_index);
+    double duration = 1.0;
+
+    if (hasTiming)
+    {
+        start = record.m_gpuStart / 1e3;
+        duration = (record.m_gpuEnd - record.m_gpuStart) / 1e3;
+    }
+
+    OutputSeparator(out, isFirstEvent);
+    out << "{\"name\": \"" << AMDT::EscapeJson(record.m_kernelName) << "\", \"cat\": \"dispatch\", \"ph\": \"X\""
+        << ", \"pid\": " << record.m_device << ", \"tid\": " << record.m_queueId
+        << ", \"ts\": " << start << ", \"dur\": " << duration
+        << ", \"args\": {\"index\": " << record.m_index
+        << ", \"packet_id\": " << record.m_packetId
+        << ", \"grid_size\": \"{" << record.m_gridSize[0] << " " << record.m_gridSize[1] << " " << record.m_gridSize[2] << "}\""
+        << ", \"workgroup_size\": \"{" << record.m_workgroupSize[0] << " " << record.m_workgroupSize[1] << " " << record.m_workgroupSize[2] << "}\""
+        << ", \"private_segment_size\": " << record.m_privateSegmentSize
+        << ", \"group_segment_size\": " << record.m_groupSegmentSize
+        << ", \"kernel_object\": " << record.m_kernelObject << "}}";
+}